@@ -0,0 +1,110 @@
+// Lookups of the Node/Cache store hashed by params, compared with the previous
+// scan of all items, and a stream of misses evicting items over the budget,
+// compared with the previous store that never drops any.
+#include "util/node_cache.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+using namespace kingtaker;
+
+namespace {
+
+using Param = NodeCacheItem::Param;
+
+constexpr size_t kItems   = 1000;
+constexpr size_t kLookups = 1000000;
+constexpr size_t kScans   = 10000;  // the scan is too slow to run kLookups
+constexpr size_t kMisses  = 100000;
+constexpr size_t kResult  = 4096;  // bytes of a result string
+constexpr size_t kBudget  = kItems*kResult;
+
+
+// params like ones set by SugarCall: an index and a common string
+std::vector<Param> ParamsOf(size_t i) noexcept {
+  return {
+    {"index", Value(static_cast<Value::Integer>(i))},
+    {"mode",  Value("linear")},
+  };
+}
+
+// the previous Store
+class ScanStore final {
+ public:
+  std::shared_ptr<std::vector<Param>> Find(const std::vector<Param>& in) const noexcept {
+    for (const auto& item : items_) {
+      if (in == *item) return item;
+    }
+    return nullptr;
+  }
+  void Allocate(std::vector<Param>&& in) noexcept {
+    items_.push_back(std::make_shared<std::vector<Param>>(std::move(in)));
+  }
+
+ private:
+  std::deque<std::shared_ptr<std::vector<Param>>> items_;
+};
+
+
+// allocates an item of the params and emits one result like a finished target
+void Store(NodeCacheStore& store, std::vector<Param>&& params) noexcept {
+  const auto hash = NodeCacheStore::HashOf(params);
+  auto item = store.Allocate(hash, std::move(params));
+  store.Set(*item, "out", Value(std::string(kResult, 'x')));
+  store.Finish(*item);
+}
+
+template <typename F>
+double NanosPerOp(size_t n, F&& f) noexcept {
+  const auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) f(i);
+  const auto dur = std::chrono::steady_clock::now()-t0;
+  return std::chrono::duration<double, std::nano>(dur).count() / static_cast<double>(n);
+}
+
+}  // namespace
+
+
+int main() {
+  NodeCacheStore store(kBudget);
+  ScanStore      scan;
+  for (size_t i = 0; i < kItems; ++i) {
+    Store(store, ParamsOf(i));
+    scan.Allocate(ParamsOf(i));
+  }
+
+  std::mt19937 rnd(1);
+  std::vector<std::vector<Param>> keys;
+  for (size_t i = 0; i < kItems; ++i) keys.push_back(ParamsOf(rnd() % kItems));
+
+  size_t hits = 0;
+  const auto hashed = NanosPerOp(kLookups, [&](size_t i) {
+    const auto& k = keys[i%kItems];
+    hits += !!store.Find(NodeCacheStore::HashOf(k), k);
+  });
+  const auto scanned = NanosPerOp(kScans, [&](size_t i) {
+    hits += !!scan.Find(keys[i%kItems]);
+  });
+
+  std::printf("items: %zu, result: %zu bytes\n", kItems, kResult);
+  std::printf("hashed hit   : %10.2f ns/lookup\n", hashed);
+  std::printf("scanned hit  : %10.2f ns/lookup\n", scanned);
+
+  // every params is new, so each exec allocates and evicts the oldest one
+  const auto evicted = NanosPerOp(kMisses, [&](size_t i) {
+    Store(store, ParamsOf(kItems+i));
+  });
+  std::printf("miss + evict : %10.2f ns/exec\n", evicted);
+  std::printf("kept %zu items, %zu / %zu bytes, %zu evicted\n",
+              store.size(), store.bytes(), store.budget(), store.evictCount());
+  std::printf("the previous store keeps %zu items, %zu bytes\n",
+              kItems+kMisses, (kItems+kMisses)*kResult);
+  std::printf("(%zu hits)\n", hits);
+  return 0;
+}
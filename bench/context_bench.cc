@@ -0,0 +1,91 @@
+// Per-receive data lookups on a chain of nodes sharing a context, compared
+// with the previous unordered_map lookup and dynamic_pointer_cast.
+#include "util/node.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+
+using namespace kingtaker;
+
+namespace {
+
+using Node    = iface::Node;
+using Context = Node::Context;
+
+constexpr size_t kChain    = 64;
+constexpr size_t kMessages = 200000;
+
+
+class BenchNode final : public Node {
+ public:
+  BenchNode(size_t slot) noexcept : Node(kNone) {
+    AssignSlot(slot);
+  }
+};
+
+class BenchData final : public Context::Data {
+ public:
+  size_t count = 0;
+};
+
+
+// the previous Context::data()
+class MapData final {
+ public:
+  void Create(Node* n) noexcept {
+    data_[n] = std::make_shared<BenchData>();
+  }
+  template <typename T>
+  std::shared_ptr<T> data(Node* n) const noexcept {
+    auto itr = data_.find(n);
+    return std::dynamic_pointer_cast<T>(itr->second);
+  }
+
+ private:
+  std::unordered_map<Node*, std::shared_ptr<Context::Data>> data_;
+};
+
+
+// passes each message through the chain and returns ns per receive
+template <typename F>
+double NanosPerReceive(F&& receive) noexcept {
+  const auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kMessages; ++i) {
+    for (size_t j = 0; j < kChain; ++j) receive(j);
+  }
+  const auto dur = std::chrono::steady_clock::now()-t0;
+  return std::chrono::duration<double, std::nano>(dur).count() /
+      static_cast<double>(kMessages*kChain);
+}
+
+}  // namespace
+
+
+int main() {
+  std::vector<std::unique_ptr<BenchNode>> nodes;
+  for (size_t i = 0; i < kChain; ++i) nodes.push_back(std::make_unique<BenchNode>(i));
+
+  auto    ctx = std::make_shared<Context>(File::Path());
+  MapData map;
+  for (auto& n : nodes) {
+    ctx->CreateData<BenchData>(n.get());
+    map.Create(n.get());
+  }
+
+  const auto flat = NanosPerReceive([&](size_t i) {
+    ++ctx->data<BenchData>(nodes[i].get())->count;
+  });
+  const auto mapped = NanosPerReceive([&](size_t i) {
+    ++map.data<BenchData>(nodes[i].get())->count;
+  });
+
+  std::printf("chain: %zu nodes, messages: %zu\n", kChain, kMessages);
+  std::printf("slot vector  : %8.2f ns/receive\n", flat);
+  std::printf("map and cast : %8.2f ns/receive\n", mapped);
+  std::printf("(%zu receives)\n", ctx->data<BenchData>(nodes[0].get())->count);
+  return 0;
+}
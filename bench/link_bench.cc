@@ -0,0 +1,125 @@
+// Lookups of NodeLinkStore on a network of 10k links, compared with the
+// previous scan of all links with socket lookups by name, and edits of links
+// one by one compared with ones pasted in an EditScope.
+#include "util/node.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+using namespace kingtaker;
+
+namespace {
+
+using Node    = iface::Node;
+using InSock  = Node::InSock;
+using OutSock = Node::OutSock;
+
+constexpr size_t kNodes   = 2000;
+constexpr size_t kSocks   = 8;  // for each side of a node
+constexpr size_t kLinks   = 10000;
+constexpr size_t kLookups = 1000000;
+constexpr size_t kScans   = 1000;  // the scan is too slow to run kLookups
+constexpr size_t kEdits   = 1000;  // links added and removed as a paste
+
+
+class BenchNode final : public Node {
+ public:
+  BenchNode() noexcept : Node(kNone) {
+    for (size_t i = 0; i < kSocks; ++i) {
+      const auto name = std::to_string(i);
+      in_insts_.push_back(std::make_unique<InSock>(this, "in"+name));
+      out_insts_.push_back(std::make_unique<OutSock>(this, "out"+name));
+      in_.push_back(in_insts_.back().get());
+      out_.push_back(out_insts_.back().get());
+    }
+  }
+
+ private:
+  std::vector<std::unique_ptr<InSock>>  in_insts_;
+  std::vector<std::unique_ptr<OutSock>> out_insts_;
+};
+
+
+// the previous GetDstOf
+std::vector<InSock*> ScanDstOf(const NodeLinkStore& links, const OutSock* sock) noexcept {
+  std::vector<InSock*> ret;
+  for (const auto& link : links.items()) {
+    if (link.out.sock != sock) continue;
+
+    const auto& name = link.in.name.str();
+    for (auto in : link.in.node->in()) {
+      if (in->name() == name) {
+        ret.push_back(in);
+        break;
+      }
+    }
+  }
+  return ret;
+}
+
+template <typename F>
+double NanosPerCall(size_t n, F&& f) noexcept {
+  const auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) f(i);
+  const auto dur = std::chrono::steady_clock::now()-t0;
+  return std::chrono::duration<double, std::nano>(dur).count() / static_cast<double>(n);
+}
+
+}  // namespace
+
+
+int main() {
+  std::vector<std::unique_ptr<BenchNode>> nodes;
+  for (size_t i = 0; i < kNodes; ++i) nodes.push_back(std::make_unique<BenchNode>());
+
+  std::mt19937_64 rnd(1);
+  auto pick = [&](size_t n) {
+    return std::uniform_int_distribution<size_t>(0, n-1)(rnd);
+  };
+
+  NodeLinkStore links;
+  std::vector<OutSock*> srcs;
+  while (links.items().size() < kLinks) {
+    auto out = &nodes[pick(kNodes)]->out(pick(kSocks));
+    auto in  = &nodes[pick(kNodes)]->in(pick(kSocks));
+    links.Link(in, out);
+    srcs.push_back(out);
+  }
+
+  size_t found = 0;
+  const auto indexed = NanosPerCall(kLookups, [&](size_t i) {
+    found += links.GetDstOf(srcs[i%srcs.size()]).size();
+  });
+  const auto scan = NanosPerCall(kScans, [&](size_t i) {
+    found += ScanDstOf(links, srcs[i%srcs.size()]).size();
+  });
+
+  std::vector<std::pair<InSock*, OutSock*>> paste;
+  for (size_t i = 0; i < kEdits; ++i) {
+    paste.emplace_back(&nodes[pick(kNodes)]->in(pick(kSocks)),
+                       &nodes[pick(kNodes)]->out(pick(kSocks)));
+  }
+  const auto edit = [&]() {
+    for (auto& [in, out] : paste) links.Link(in, out);
+    for (auto& [in, out] : paste) links.Unlink(in, out);
+  };
+  const auto single = NanosPerCall(1, [&](size_t) { edit(); });
+  const auto scoped = NanosPerCall(1, [&](size_t) {
+    NodeLinkStore::EditScope _(links);
+    edit();
+  });
+
+  std::printf("links: %zu, nodes: %zu\n", links.items().size(), kNodes);
+  std::printf("GetDstOf : %12.1f ns/lookup\n", indexed);
+  std::printf("scan     : %12.1f ns/lookup\n", scan);
+  std::printf("(%zu destinations found)\n", found);
+  std::printf("paste of %zu links, then removal of them\n", kEdits);
+  std::printf("one by one : %12.1f us\n", single/1000.);
+  std::printf("EditScope  : %12.1f us\n", scoped/1000.);
+  return 0;
+}
@@ -0,0 +1,127 @@
+// Throughput of CpuQueue compared with the previous design, where all workers
+// share one mutex and deque, for 1, 2, 8 and 32 producers. CpuQueue is also
+// measured while durations are timed, as when QueueMonitor is shown.
+#include "util/queue.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+using namespace kingtaker;
+
+namespace {
+
+constexpr size_t kTasks = 1000000;
+
+constexpr size_t kProducers[] = {1, 2, 8, 32};
+
+
+// the previous CpuQueue, waiting with a predicate to finish reliably
+class LockedQueue final : public Queue {
+ public:
+  LockedQueue(size_t n) noexcept : th_(n) {
+    for (auto& t : th_) t = std::thread([this]() { Main(); });
+  }
+  ~LockedQueue() noexcept {
+    {
+      std::unique_lock<std::mutex> _(mtx_);
+      alive_ = false;
+    }
+    cv_.notify_all();
+    for (auto& t : th_) t.join();
+  }
+
+  void Push(Task&& t) noexcept override {
+    std::unique_lock<std::mutex> _(mtx_);
+    q_.push_back(std::move(t));
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex              mtx_;
+  std::condition_variable cv_;
+  std::deque<Task>        q_;
+
+  bool alive_ = true;
+
+  std::vector<std::thread> th_;
+
+
+  void Main() noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    for (;;) {
+      cv_.wait(k, [this]() { return !alive_ || q_.size(); });
+      if (q_.empty()) return;
+
+      auto task = std::move(q_.front());
+      q_.pop_front();
+      k.unlock();
+      task();
+      k.lock();
+    }
+  }
+};
+
+
+// returns tasks per second
+double Measure(Queue& q, size_t producers) noexcept {
+  std::atomic<size_t> done = 0;
+
+  const auto t0 = std::chrono::steady_clock::now();
+  std::vector<std::thread> th;
+  for (size_t i = 0; i < producers; ++i) {
+    th.emplace_back([&q, &done, n = kTasks/producers]() {
+      for (size_t j = 0; j < n; ++j) {
+        q.Push([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+      }
+    });
+  }
+  for (auto& t : th) t.join();
+
+  const auto total = kTasks/producers*producers;
+  while (done.load() < total) std::this_thread::yield();
+
+  const auto dur = std::chrono::steady_clock::now()-t0;
+  return static_cast<double>(total) / std::chrono::duration<double>(dur).count();
+}
+
+}  // namespace
+
+
+int main() {
+  const size_t hw = std::max(std::thread::hardware_concurrency(), 1u);
+  std::printf("tasks: %zu, hardware threads: %zu\n", kTasks, hw);
+  std::printf("%-10s %16s %16s %16s %16s\n",
+              "producers", "locked x2", "locked xN", "stealing xN", "timed xN");
+
+  for (const auto p : kProducers) {
+    double locked2, lockedn, stealing, timed;
+    {
+      LockedQueue q(2);
+      locked2 = Measure(q, p);
+    }
+    {
+      LockedQueue q(hw);
+      lockedn = Measure(q, p);
+    }
+    {
+      CpuQueue q(hw);
+      stealing = Measure(q, p);
+    }
+    {
+      QueueStats::Session session;
+      CpuQueue q(hw);
+      timed = Measure(q, p);
+    }
+    std::printf("%-10zu %13.2f M/s %13.2f M/s %13.2f M/s %13.2f M/s\n",
+                p, locked2/1e6, lockedn/1e6, stealing/1e6, timed/1e6);
+  }
+  return 0;
+}
@@ -16,6 +16,7 @@
 #include "util/node.hh"
 #include "util/node_logger.hh"
 #include "util/ptr_selector.hh"
+#include "util/snapshot.hh"
 #include "util/value.hh"
 
 namespace kingtaker {
@@ -57,6 +58,12 @@ class Texture final : public LambdaNodeDriver {
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_ = ctx;
+    Clear();
+    return true;
+  }
+
   void Handle(size_t idx, Value&& v) {
     switch (idx) {
     case 0:
@@ -154,6 +161,12 @@ class Renderbuffer final : public LambdaNodeDriver {
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_ = ctx;
+    Clear();
+    return true;
+  }
+
   void Handle(size_t idx, Value&& v) {
     switch (idx) {
     case 0:
@@ -241,6 +254,12 @@ class Framebuffer final : public LambdaNodeDriver {
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_ = ctx;
+    Clear();
+    return true;
+  }
+
   void Handle(size_t idx, Value&& v) {
     switch (idx) {
     case 0:
@@ -361,6 +380,11 @@ class VertexArray final : public LambdaNodeDriver {
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_ = ctx;
+    return true;
+  }
+
   void Handle(size_t idx, Value&&) {
     switch (idx) {
     case 0: Exec(); return;
@@ -411,6 +435,12 @@ class Program final : public LambdaNodeDriver {
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_ = ctx;
+    Clear();
+    return true;
+  }
+
   void Handle(size_t idx, Value&& v) {
     switch (idx) {
     case 0:
@@ -505,6 +535,12 @@ class Shader final : public LambdaNodeDriver {
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_ = ctx;
+    Clear();
+    return true;
+  }
+
   void Handle(size_t idx, Value&& v) {
     switch (idx) {
     case 0:
@@ -611,6 +647,12 @@ class DrawArrays final : public LambdaNodeDriver {
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_ = ctx;
+    Clear();
+    return true;
+  }
+
   void Handle(size_t idx, Value&& v) {
     switch (idx) {
     case 0:
@@ -793,7 +835,8 @@ class Preview final : public File, public iface::DirItem, public iface::Node {
       shown_(shown) {
     auto task_tex = [this](auto& ctx, auto&& v) {
       try {
-        tex_ = v.template dataPtr<gl::Texture>();
+        tex_.Store(v.template dataPtr<gl::Texture>());
+        File::RequestRedraw();
       } catch (Exception& e) {
         NodeLoggerTextItem::Error(abspath(), *ctx, "while handling (tex), "+e.msg());
       }
@@ -815,12 +858,13 @@ class Preview final : public File, public iface::DirItem, public iface::Node {
 
   void Update(Event& ev) noexcept override {
     if (gui::BeginWindow(this, "OpenGL Preview", ev, &shown_)) {
-      if (!tex_) {
+      const auto tex = tex_.Load();
+      if (!tex) {
         ImGui::TextUnformatted("texture is not specified");
-      } else if (tex_->id() == 0) {
+      } else if (tex->id() == 0) {
         ImGui::TextUnformatted("texture is not ready");
       } else {
-        const auto id = (ImTextureID) static_cast<uintptr_t>(tex_->id());
+        const auto id = (ImTextureID) static_cast<uintptr_t>(tex->id());
         ImGui::Image(id, ImGui::GetContentRegionAvail());
       }
     }
@@ -836,7 +880,8 @@ class Preview final : public File, public iface::DirItem, public iface::Node {
   bool shown_;
 
   // volatile
-  std::shared_ptr<gl::Texture> tex_;
+  // written by contexts on different sub shards concurrently
+  SnapshotPtr<gl::Texture> tex_;
 };
 
 
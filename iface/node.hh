@@ -1,14 +1,20 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <optional>
+#include <shared_mutex>
 #include <span>
 #include <string>
 #include <string_view>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -16,6 +22,9 @@
 
 #include "iface/logger.hh"
 
+#include "util/node_profiler.hh"
+#include "util/symbol.hh"
+#include "util/tracer.hh"
 #include "util/value.hh"
 
 
@@ -32,9 +41,20 @@ class Node {
   class  InSock;
   class  OutSock;
 
+  template <typename T> class SockList;
+
   enum Flag : uint8_t {
     kNone = 0,
     kMenu = 0b1,
+
+    // passes values to nodes outside of the network owning it,
+    // such as a nested network or a node calling another file
+    kExternal = 0b10,
+
+    // Receive() touches nothing but the context data of the node and states
+    // never changed while delivering, so it can run on any thread while other
+    // nodes are receiving (parallel fan-out runs only such nodes on CPU threads)
+    kReentrant = 0b100,
   };
   using Flags = uint8_t;
 
@@ -61,8 +81,18 @@ class Node {
   inline InSock* in(std::string_view) const noexcept;
   inline OutSock* out(std::string_view) const noexcept;
 
+  // faster than the string versions
+  inline InSock* in(Symbol) const noexcept;
+  inline OutSock* out(Symbol) const noexcept;
+
   Flags flags() const noexcept { return flags_; }
 
+  // An index of the data in Context, which is assigned by the owner that
+  // initializes multiple nodes with the same context, such as Node/Network.
+  // Nodes sharing a context should have different slots to be found quickly.
+  size_t slot() const noexcept { return slot_; }
+  void AssignSlot(size_t s) noexcept { slot_ = s; }
+
  protected:
   std::vector<InSock*> in_;
   std::vector<OutSock*> out_;
@@ -74,6 +104,8 @@ class Node {
   std::vector<Observer*> obs_;
 
   Flags flags_;
+
+  size_t slot_ = 0;
 };
 
 class Node::Observer {
@@ -115,18 +147,60 @@ void Node::NotifySockChange() const noexcept {
   }
 }
 
+// A list of sockets that keeps the version of links alive while it's held.
+template <typename T>
+class Node::SockList final {
+ public:
+  SockList() = default;
+  SockList(std::span<T* const>         items,
+           std::shared_ptr<const void>&& pin      = nullptr,
+           std::span<const uint32_t>     branches = {}) noexcept :
+      items_(items), branches_(branches), pin_(std::move(pin)) {
+  }
+
+  auto begin() const noexcept { return items_.begin(); }
+  auto end() const noexcept { return items_.end(); }
+
+  T* operator[](size_t i) const noexcept { return items_[i]; }
+  T* back() const noexcept { return items_.back(); }
+
+  size_t size() const noexcept { return items_.size(); }
+  bool empty() const noexcept { return items_.empty(); }
+
+  std::span<T* const> span() const noexcept { return items_; }
+
+  // Branch indices of items numbered in order of appearance. Items in
+  // different branches never reach the same node, and can be delivered in
+  // parallel. Branch 0 has all items reaching nodes that are not re-entrant,
+  // which must be delivered in the sending thread. Empty if none can be
+  // delivered in parallel.
+  std::span<const uint32_t> branches() const noexcept { return branches_; }
+
+ private:
+  std::span<T* const> items_;
+
+  std::span<const uint32_t> branches_;
+
+  std::shared_ptr<const void> pin_;
+};
+
 class Node::Context {
  public:
   class Data {
    public:
     Data() = default;
     virtual ~Data() = default;
+
+    // Clears the state to reuse the data in a recycled context, ctx.
+    // Returns false if it cannot, and then the node is initialized again.
+    virtual bool Reset(const std::shared_ptr<Context>&) noexcept { return false; }
   };
 
   Context() = delete;
   Context(File::Path&&                    basepath,
           const std::shared_ptr<Context>& octx = nullptr) noexcept :
-      basepath_(std::move(basepath)), octx_(octx), depth_(octx? octx->depth()+1: 0) {
+      basepath_(std::move(basepath)), octx_(octx), depth_(octx? octx->depth()+1: 0),
+      affinity_(octx? octx->affinity(): next_affinity_++) {
   }
   virtual ~Context() = default;
   Context(const Context&) = delete;
@@ -143,11 +217,12 @@ class Node::Context {
   }
 
   // Returns an empty when the socket is destructed or missing.
-  virtual std::vector<InSock*> GetDstOf(const OutSock* s) const noexcept {
+  // Must be thread-safe and the result is never changed by link edits.
+  virtual SockList<InSock> GetDstOf(const OutSock* s) const noexcept {
     if (!octx_) return {};
     return octx_->GetDstOf(s);
   }
-  virtual std::vector<OutSock*> GetSrcOf(const InSock* s) const noexcept {
+  virtual SockList<OutSock> GetSrcOf(const InSock* s) const noexcept {
     if (!octx_) return {};
     return octx_->GetSrcOf(s);
   }
@@ -155,18 +230,44 @@ class Node::Context {
   template <typename T, typename... Args>
   std::shared_ptr<T> CreateData(Node* n, Args... args) noexcept {
     auto ret = std::make_shared<T>(std::forward<Args>(args)...);
-    data_[n] = ret;
+    SetData(n, ret);
     return ret;
   }
+  // T must be the type passed to CreateData
   template <typename T>
   std::shared_ptr<T> data(Node* n) const noexcept {
-    auto itr = data_.find(n);
-    assert(itr != data_.end());
-    auto ret = std::dynamic_pointer_cast<T>(itr->second);
-    assert(ret);
+    auto k   = LockData();
+    auto ptr = FindData(n);
+    assert(ptr && dynamic_cast<T*>(ptr->get()));
+    return std::static_pointer_cast<T>(*ptr);
+  }
+
+  // Resets all data for the context recycled as self.
+  // Returns false if any of them cannot be reset.
+  bool ResetData(const std::shared_ptr<Context>& self) noexcept {
+    assert(self.get() == this);
+    bool ret = true;
+    for (auto& slot : data_) {
+      if (slot.data && !slot.data->Reset(self)) ret = false;
+    }
+    for (auto& p : data_overflow_) {
+      if (!p.second->Reset(self)) ret = false;
+    }
     return ret;
   }
 
+  // Moves a recycled context under another parent. Unbind() releases the
+  // parent while the context is kept in a pool.
+  void Rebind(File::Path&& basepath, const std::shared_ptr<Context>& octx) noexcept {
+    basepath_ = std::move(basepath);
+    octx_     = octx;
+    depth_    = octx? octx->depth()+1: 0;
+    affinity_ = octx? octx->affinity(): next_affinity_++;
+  }
+  void Unbind() noexcept {
+    octx_ = nullptr;
+  }
+
   std::vector<File::Path> GetStackTrace() const noexcept {
     std::vector<File::Path> ret;
     ret.reserve(depth_+1);
@@ -183,14 +284,61 @@ class Node::Context {
   const std::shared_ptr<Context>& octx() const noexcept { return octx_; }
   size_t depth() const noexcept { return depth_; }
 
+  // shared by all contexts under the same root context
+  // tasks for the context should be pushed into Queue::sub(affinity())
+  size_t affinity() const noexcept { return affinity_; }
+
  private:
+  friend class OutSock;
+
+  static inline std::atomic<size_t> next_affinity_ = 0;
+
   File::Path basepath_;
 
   std::shared_ptr<Context> octx_;
 
   size_t depth_;
 
-  std::unordered_map<Node*, std::shared_ptr<Data>> data_;
+  size_t affinity_;
+
+  // indexed by Node::slot(), and data of nodes with conflicting slots go to the map
+  struct DataSlot final {
+    Node* node = nullptr;
+    std::shared_ptr<Data> data;
+  };
+  std::vector<DataSlot> data_;
+  std::unordered_map<Node*, std::shared_ptr<Data>> data_overflow_;
+
+  // data are locked only while branches forked by OutSock run concurrently
+  std::atomic<size_t>       forks_ = 0;
+  mutable std::shared_mutex data_mtx_;
+
+
+  std::shared_lock<std::shared_mutex> LockData() const noexcept {
+    if (!forks_.load(std::memory_order_relaxed)) return {};
+    return std::shared_lock<std::shared_mutex>(data_mtx_);
+  }
+  void SetData(Node* n, std::shared_ptr<Data>&& d) noexcept {
+    std::unique_lock<std::shared_mutex> k(data_mtx_, std::defer_lock);
+    if (forks_.load(std::memory_order_relaxed)) k.lock();
+
+    const auto s = n->slot();
+    if (s >= data_.size()) data_.resize(s+1);
+
+    auto& slot = data_[s];
+    if (!slot.node || slot.node == n) {
+      slot = {n, std::move(d)};
+    } else {
+      data_overflow_[n] = std::move(d);
+    }
+  }
+  const std::shared_ptr<Data>* FindData(Node* n) const noexcept {
+    const auto s = n->slot();
+    if (s < data_.size() && data_[s].node == n) return &data_[s].data;
+
+    auto itr = data_overflow_.find(n);
+    return itr != data_overflow_.end()? &itr->second: nullptr;
+  }
 };
 
 class Node::Editor : public Context {
@@ -208,14 +356,10 @@ class Node::Editor : public Context {
   virtual void Unlink(const InSock&, const OutSock&) noexcept = 0;
 
   void Unlink(const InSock& in) noexcept {
-    const auto src_span = GetSrcOf(&in);
-    std::vector<OutSock*> srcs(src_span.begin(), src_span.end());
-    for (const auto& out : srcs) Unlink(in, *out);
+    for (const auto& out : GetSrcOf(&in)) Unlink(in, *out);
   }
   void Unlink(const OutSock& out) noexcept {
-    const auto dst_span = GetDstOf(&out);
-    std::vector<InSock*> dsts(dst_span.begin(), dst_span.end());
-    for (const auto& in : dsts) Unlink(*in, out);
+    for (const auto& in : GetDstOf(&out)) Unlink(*in, out);
   }
 };
 
@@ -230,11 +374,12 @@ class Node::Sock {
   Sock& operator=(Sock&&) = delete;
 
   Node* owner() const noexcept { return owner_; }
-  const std::string& name() const noexcept { return name_; }
+  const std::string& name() const noexcept { return name_.str(); }
+  Symbol symbol() const noexcept { return name_; }
 
  private:
   Node* owner_;
-  std::string name_;
+  Symbol name_;
 };
 
 class Node::InSock : public Sock {
@@ -250,30 +395,411 @@ class Node::OutSock : public Sock {
   }
 
   // thread-safe
-  void Send(const std::shared_ptr<Context>& ctx, Value&& v) noexcept {
-    ctx->ObserveSend(*this, v);
-
-    auto task = [self = this, ctx, v = std::move(v)]() {
-      // self may be destructed already but GetDstOf can take invalid pointer
-      const auto dst = ctx->GetDstOf(self);
-      for (const auto& other : dst) {
-        ctx->ObserveReceive(*other, v);
-        other->Receive(ctx, Value(v));
+  // Values sent while delivering another value are collected and pushed
+  // as one task for each queue after the delivery.
+  inline void Send(const std::shared_ptr<Context>& ctx, Value&& v) noexcept;
+
+  // Delivers the value in the current thread without a queue hop when called
+  // while delivering another value with the same affinity. Otherwise, or when
+  // direct calls nest too deeply or it's in a forked branch, it falls back to
+  // Send().
+  inline void SendDirect(const std::shared_ptr<Context>& ctx, Value&& v) noexcept;
+
+ private:
+  class Batch;
+  class Fork;
+
+  static constexpr size_t kMaxDirectDepth = 64;
+
+  static inline thread_local size_t direct_depth_ = 0;
+
+  // true while running a branch forked by Fork
+  static inline thread_local bool forked_ = false;
+
+  // affinity of the context being received in the current thread
+  static constexpr size_t kNoAffinity = SIZE_MAX;
+  static inline thread_local size_t affinity_ = kNoAffinity;
+
+  // taken at sending only while profiling or tracing
+  struct Stamp final {
+    NodeProfiler::Time time;
+    uint64_t           flow = 0;
+  };
+  Stamp Sent(const Context& ctx, const Value& v) noexcept {
+    Stamp ret;
+    if (NodeProfiler::enabled()) ret.time = NodeProfiler::Clock::now();
+    if (Tracer::enabled()) ret.flow = TraceSend(ctx, v);
+    return ret;
+  }
+  inline uint64_t TraceSend(const Context&, const Value&) noexcept;
+
+  // returns a path of the node if the current thread holds the filesystem lock
+  static inline std::shared_ptr<const std::string> TracePath(const Node*) noexcept;
+
+  // self may be destructed already but GetDstOf can take invalid pointer
+  static void Deliver(OutSock*                        self,
+                      const std::shared_ptr<Context>& ctx,
+                      Value&&                         v,
+                      Stamp                           stamp) noexcept {
+    Deliver(ctx, ctx->GetDstOf(self), std::move(v), stamp);
+  }
+  static inline void Deliver(const std::shared_ptr<Context>& ctx,
+                             const SockList<InSock>&         dst,
+                             Value&&                         v,
+                             Stamp                           stamp) noexcept;
+  static void Deliver(const std::shared_ptr<Context>& ctx,
+                      std::span<InSock* const>        dst,
+                      Value&&                         v,
+                      Stamp                           stamp) noexcept {
+    if (dst.empty()) return;
+    for (size_t i = 0; i+1 < dst.size(); ++i) {
+      Receive(ctx, *dst[i], Value(v), stamp);
+    }
+    // the last receiver takes the value
+    Receive(ctx, *dst.back(), std::move(v), stamp);
+  }
+  static void Receive(const std::shared_ptr<Context>& ctx,
+                      InSock&                         in,
+                      Value&&                         v,
+                      Stamp                           stamp) noexcept {
+    ctx->ObserveReceive(in, v);
+
+    const auto prev = std::exchange(affinity_, ctx->affinity());
+    if (!NodeProfiler::enabled() && !Tracer::enabled()) {
+      in.Receive(ctx, std::move(v));
+    } else {
+      ReceiveMeasured(ctx, in, std::move(v), stamp);
+    }
+    affinity_ = prev;
+  }
+  static inline void ReceiveMeasured(const std::shared_ptr<Context>&,
+                                     InSock&, Value&&, Stamp) noexcept;
+};
+
+// Collects values sent in the current thread while delivering.
+class Node::OutSock::Batch final {
+ public:
+  friend class OutSock;
+
+  struct Item final {
+    OutSock* sock;
+    std::shared_ptr<Context> ctx;
+    Value v;
+    Stamp stamp;
+  };
+  using Items = std::vector<Item>;
+
+  static constexpr size_t kPoolSize = 16;
+
+  // Runs f while collecting sends, and pushes them after that.
+  template <typename F>
+  static void Run(F&& f) noexcept {
+    Batch b;
+    auto prev = std::exchange(current_, &b);
+    f();
+    current_ = prev;
+    b.Flush();
+  }
+
+  // Runs f, and delivers values sent within ctx in the current thread up to
+  // the rounds. Others are passed to the outer batch, or pushed if no one.
+  template <typename F>
+  static void RunWithin(const Context* ctx, size_t rounds, F&& f) noexcept {
+    Batch b;
+    auto prev = std::exchange(current_, &b);
+    f();
+    for (size_t i = 0; i < rounds; ++i) {
+      auto items = b.Take(ctx);
+      const bool empty = items.empty();
+      DeliverAll(items);
+      Recycle(std::move(items));
+      if (empty) break;
+    }
+    current_ = prev;
+    if (prev) {
+      for (auto& g : b.groups_) {
+        for (auto& item : g.second) prev->Add(*g.first, std::move(item));
+        Recycle(std::move(g.second));
       }
-    };
-    Queue::sub().Push(std::move(task));
+      b.groups_.clear();
+    }
+    b.Flush();
+  }
+
+  void Add(Queue& q, Item&& item) noexcept {
+    auto itr = std::find_if(groups_.begin(), groups_.end(),
+                            [&q](auto& g) { return g.first == &q; });
+    if (itr == groups_.end()) {
+      groups_.emplace_back(&q, NewItems());
+      itr = groups_.end()-1;
+    }
+    itr->second.push_back(std::move(item));
+  }
+
+ private:
+  static inline thread_local Batch* current_ = nullptr;
+
+  static inline thread_local std::vector<Items> pool_;
+
+  std::vector<std::pair<Queue*, Items>> groups_;
+
+
+  void Flush() noexcept {
+    for (auto& g : groups_) {
+      // items can be taken by RunWithin
+      if (g.second.empty()) {
+        Recycle(std::move(g.second));
+        continue;
+      }
+      auto task = [items = std::move(g.second)]() mutable {
+        Run([&]() { DeliverAll(items); });
+        Recycle(std::move(items));
+      };
+      g.first->Push(std::move(task));
+    }
+  }
+
+  // takes items sent within ctx keeping their order
+  Items Take(const Context* ctx) noexcept {
+    auto ret = NewItems();
+    for (auto& g : groups_) {
+      auto& items = g.second;
+      auto  itr   = std::stable_partition(
+          items.begin(), items.end(), [ctx](auto& x) { return x.ctx.get() != ctx; });
+      std::move(itr, items.end(), std::back_inserter(ret));
+      items.erase(itr, items.end());
+    }
+    return ret;
+  }
+
+  static void DeliverAll(Items& items) noexcept {
+    // destinations are looked up once for each run of the same socket
+    SockList<InSock> dst;
+    const OutSock* sock = nullptr;
+    const Context* ctx  = nullptr;
+    for (auto& item : items) {
+      if (item.sock != sock || item.ctx.get() != ctx) {
+        sock = item.sock;
+        ctx  = item.ctx.get();
+        dst  = item.ctx->GetDstOf(item.sock);
+      }
+      OutSock::Deliver(item.ctx, dst, std::move(item.v), item.stamp);
+    }
+  }
+
+  static Items NewItems() noexcept {
+    if (pool_.empty()) return {};
+    auto ret = std::move(pool_.back());
+    pool_.pop_back();
+    return ret;
+  }
+  static void Recycle(Items&& items) noexcept {
+    items.clear();
+    if (pool_.size() < kPoolSize) pool_.push_back(std::move(items));
+  }
+};
+// Runs independent branches of destinations on CPU threads, and waits for them
+// while running the first branch, which has nodes that are not re-entrant, in
+// the current thread. Since the current thread keeps holding the filesystem
+// lock, the branches can access files safely.
+// Values sent within the context while running a branch never reach other
+// branches, so they are delivered in the same thread until kMaxRounds.
+class Node::OutSock::Fork final {
+ public:
+  static constexpr size_t kMaxRounds = 64;
+
+  static void Run(const std::shared_ptr<Context>& ctx,
+                  const SockList<InSock>&         dst,
+                  Value&&                         v,
+                  Stamp                           stamp) noexcept {
+    auto f = std::make_shared<Fork>(ctx, dst, std::move(v), stamp);
+    for (size_t i = 1; i < f->size(); ++i) {
+      Queue::cpu().Push([f]() { f->Work(); });
+    }
+    f->RunBranch(0);
+    f->Work();
+    f->Wait();
+  }
+
+  Fork(const std::shared_ptr<Context>& ctx,
+       const SockList<InSock>&         dst,
+       Value&&                         v,
+       Stamp                           stamp) noexcept :
+      ctx_(ctx), dst_(dst), v_(std::move(v)), stamp_(stamp),
+      size_(*std::max_element(dst.branches().begin(), dst.branches().end())+size_t {1}) {
+  }
+
+  size_t size() const noexcept { return size_; }
+
+ private:
+  std::shared_ptr<Context> ctx_;
+  SockList<InSock>         dst_;
+  Value                    v_;
+  Stamp                    stamp_;
+
+  size_t size_;
+
+  std::atomic<size_t> next_ = 1;  // the first is taken by Run()
+  std::atomic<size_t> done_ = 0;
+
+
+  // takes branches until no one is left
+  void Work() noexcept {
+    for (;;) {
+      const auto i = next_.fetch_add(1);
+      if (i >= size()) break;
+      RunBranch(i);
+    }
+  }
+  void RunBranch(size_t i) noexcept {
+    const auto prev = std::exchange(forked_, true);
+    Batch::RunWithin(ctx_.get(), kMaxRounds, [&]() {
+      const auto br  = dst_.branches();
+      const auto dst = dst_.span();
+      for (size_t j = 0; j < dst.size(); ++j) {
+        if (br[j] == i) Receive(ctx_, *dst[j], Value(v_), stamp_);
+      }
+    });
+    forked_ = prev;
+
+    done_.fetch_add(1, std::memory_order_release);
+    done_.notify_one();
+  }
+  void Wait() const noexcept {
+    for (auto n = done_.load(std::memory_order_acquire); n < size();
+         n = done_.load(std::memory_order_acquire)) {
+      done_.wait(n, std::memory_order_acquire);
+    }
   }
 };
+void Node::OutSock::Deliver(const std::shared_ptr<Context>& ctx,
+                            const SockList<InSock>&         dst,
+                            Value&&                         v,
+                            Stamp                           stamp) noexcept {
+  if (dst.branches().size()) {
+    ++ctx->forks_;
+    Fork::Run(ctx, dst, std::move(v), stamp);
+    --ctx->forks_;
+    return;
+  }
+  Deliver(ctx, dst.span(), std::move(v), stamp);
+}
+void Node::OutSock::ReceiveMeasured(const std::shared_ptr<Context>& ctx,
+                                    InSock&                         in,
+                                    Value&&                         v,
+                                    Stamp                           stamp) noexcept {
+  const auto vtype = v.StringifyType();
+  const auto begin = Tracer::Clock::now();
+  {
+    std::optional<NodeProfiler::Scope> prof;
+    if (NodeProfiler::enabled()) {
+      prof.emplace(in.owner(), ctx.get(), ctx->affinity(), ctx->depth(), stamp.time);
+    }
+    in.Receive(ctx, std::move(v));
+  }
+  if (!Tracer::enabled()) return;
+
+  const auto end = Tracer::Clock::now();
+  Tracer::Record([&](auto& ev) {
+    ev.type       = Tracer::kReceive;
+    ev.sock       = in.symbol();
+    ev.path       = TracePath(in.owner());
+    ev.node       = in.owner();
+    ev.generation = File::generation();
+    ev.depth      = ctx->depth();
+    ev.vtype      = vtype;
+    ev.flow       = stamp.flow;
+    ev.begin      = begin;
+    ev.dur        = end-begin;
+  });
+}
+uint64_t Node::OutSock::TraceSend(const Context& ctx, const Value& v) noexcept {
+  const auto flow = Tracer::NewFlow();
+  Tracer::Record([&](auto& ev) {
+    ev.type       = Tracer::kSend;
+    ev.sock       = symbol();
+    ev.path       = TracePath(owner());
+    ev.node       = owner();
+    ev.generation = File::generation();
+    ev.depth      = ctx.depth();
+    ev.vtype      = v.StringifyType();
+    ev.flow       = flow;
+    ev.begin      = Tracer::Clock::now();
+  });
+  return flow;
+}
+std::shared_ptr<const std::string> Node::OutSock::TracePath(const Node* n) noexcept {
+  // values are delivered only in threads holding the lock
+  if (!Batch::current_) return {};
+
+  // paths are not interned as Symbol because they are unbounded, and the
+  // events keep ones dropped from the cache alive
+  struct Cache final {
+    uint64_t generation = 0;
+    std::unordered_map<const Node*, std::shared_ptr<const std::string>> paths;
+  };
+  static thread_local Cache cache;
+
+  const auto gen = File::generation();
+  if (cache.generation != gen) {
+    cache.generation = gen;
+    cache.paths.clear();
+  }
+  auto& ret = cache.paths[n];
+  if (!ret) {
+    auto f = dynamic_cast<const File*>(n);
+    ret = std::make_shared<const std::string>(f? f->abspath().Stringify(): "");
+  }
+  return ret;
+}
+void Node::OutSock::Send(const std::shared_ptr<Context>& ctx, Value&& v) noexcept {
+  ctx->ObserveSend(*this, v);
+
+  auto& q = Queue::sub(ctx->affinity());
+  if (auto b = Batch::current_) {
+    const auto stamp = Sent(*ctx, v);
+    b->Add(q, {this, ctx, std::move(v), stamp});
+    return;
+  }
+  auto task = [self = this, ctx, stamp = Sent(*ctx, v), v = std::move(v)]() mutable {
+    Batch::Run([&]() { Deliver(self, ctx, std::move(v), stamp); });
+  };
+  q.Push(std::move(task));
+}
+void Node::OutSock::SendDirect(const std::shared_ptr<Context>& ctx, Value&& v) noexcept {
+  // a forked branch can reach outside of the branch through a direct call
+  if (!Batch::current_ || forked_ || direct_depth_ >= kMaxDirectDepth ||
+      affinity_ != ctx->affinity()) {
+    Send(ctx, std::move(v));
+    return;
+  }
+  ctx->ObserveSend(*this, v);
+
+  const auto stamp = Sent(*ctx, v);
+
+  ++direct_depth_;
+  Deliver(this, ctx, std::move(v), stamp);
+  --direct_depth_;
+}
 
 Node::InSock* Node::in(std::string_view name) const noexcept {
+  // no socket has the name if it has never been interned
+  const auto sym = Symbol::Find(name);
+  return sym? in(sym): nullptr;
+}
+Node::OutSock* Node::out(std::string_view name) const noexcept {
+  const auto sym = Symbol::Find(name);
+  return sym? out(sym): nullptr;
+}
+Node::InSock* Node::in(Symbol name) const noexcept {
   for (const auto& sock : in_) {
-    if (sock->name() == name) return sock;
+    if (sock->symbol() == name) return sock;
   }
   return nullptr;
 }
-Node::OutSock* Node::out(std::string_view name) const noexcept {
+Node::OutSock* Node::out(Symbol name) const noexcept {
   for (const auto& sock : out_) {
-    if (sock->name() == name) return sock;
+    if (sock->symbol() == name) return sock;
   }
   return nullptr;
 }
@@ -105,6 +105,7 @@ void File::Touch() noexcept {
 void File::Move(File* parent, std::string_view name) noexcept {
   parent_ = parent;
   name_   = name;
+  generation_.fetch_add(1, std::memory_order_release);
 }
 
 File::Path File::abspath() const noexcept {
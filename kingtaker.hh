@@ -4,14 +4,17 @@
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstddef>
 #include <cstring>
 #include <filesystem>
 #include <functional>
 #include <memory>
+#include <new>
 #include <string>
 #include <string_view>
 #include <type_traits>
 #include <typeindex>
+#include <utility>
 #include <map>
 #include <variant>
 #include <vector>
@@ -77,10 +80,122 @@ class DeserializeException : public HeavyException {
 };
 
 
+// Move-only callable object. Unlike std::function, a callable that fits in
+// N bytes is stored in the object itself without heap allocation.
+template <typename Sig, size_t N = 64>
+class SmallFunction;
+
+template <typename R, typename... Args, size_t N>
+class SmallFunction<R(Args...), N> final {
+ public:
+  SmallFunction() = default;
+  SmallFunction(std::nullptr_t) noexcept { }
+  template <typename F>
+  requires (!std::is_same_v<std::decay_t<F>, SmallFunction> &&
+            std::is_invocable_r_v<R, std::decay_t<F>&, Args...>)
+  SmallFunction(F&& f) noexcept {
+    using T = std::decay_t<F>;
+    if constexpr (kInline<T>) {
+      new (buf_) T(std::forward<F>(f));
+    } else {
+      *reinterpret_cast<T**>(buf_) = new T(std::forward<F>(f));
+    }
+    vt_ = &kVTable<T>;
+  }
+  ~SmallFunction() noexcept {
+    Reset();
+  }
+  SmallFunction(const SmallFunction&) = delete;
+  SmallFunction(SmallFunction&& src) noexcept {
+    MoveFrom(src);
+  }
+  SmallFunction& operator=(const SmallFunction&) = delete;
+  SmallFunction& operator=(SmallFunction&& src) noexcept {
+    if (this != &src) {
+      Reset();
+      MoveFrom(src);
+    }
+    return *this;
+  }
+  SmallFunction& operator=(std::nullptr_t) noexcept {
+    Reset();
+    return *this;
+  }
+
+  R operator()(Args... args) {
+    assert(vt_);
+    return vt_->call(buf_, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const noexcept { return !!vt_; }
+
+ private:
+  struct VTable final {
+    R    (*call)(void*, Args&&...);
+    void (*move)(void* dst, void* src) noexcept;
+    void (*destroy)(void*) noexcept;
+  };
+
+  template <typename T>
+  static constexpr bool kInline =
+      sizeof(T) <= N &&
+      alignof(T) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<T>;
+
+  template <typename T>
+  static T& Get(void* p) noexcept {
+    if constexpr (kInline<T>) {
+      return *std::launder(reinterpret_cast<T*>(p));
+    } else {
+      return **reinterpret_cast<T**>(p);
+    }
+  }
+
+  template <typename T>
+  static inline const VTable kVTable = {
+    [](void* p, Args&&... args) -> R {
+      return static_cast<R>(Get<T>(p)(std::forward<Args>(args)...));
+    },
+    [](void* dst, void* src) noexcept {
+      if constexpr (kInline<T>) {
+        new (dst) T(std::move(Get<T>(src)));
+        Get<T>(src).~T();
+      } else {
+        *reinterpret_cast<T**>(dst) = *reinterpret_cast<T**>(src);
+      }
+    },
+    [](void* p) noexcept {
+      if constexpr (kInline<T>) {
+        Get<T>(p).~T();
+      } else {
+        delete &Get<T>(p);
+      }
+    },
+  };
+
+  alignas(std::max_align_t) std::byte buf_[N];
+
+  const VTable* vt_ = nullptr;
+
+
+  void Reset() noexcept {
+    if (!vt_) return;
+    vt_->destroy(buf_);
+    vt_ = nullptr;
+  }
+  void MoveFrom(SmallFunction& src) noexcept {
+    if (!src.vt_) return;
+    src.vt_->move(buf_, src.buf_);
+    vt_ = std::exchange(src.vt_, nullptr);
+  }
+};
+
+
 // Task queue. Any operations are thread-safe.
 class Queue {
  public:
-  using Task = std::function<void()>;
+  // Tasks capturing a few pointers and a Value are stored without allocation.
+  using Task = SmallFunction<void()>;
 
   // synchronized with kingtaker filesystem
   // and all tasks are processed on each GUI update
@@ -90,6 +205,12 @@ class Queue {
   // some tasks might not be done if display update is done faster than them
   static Queue& sub() noexcept;
 
+  // tasks with the same affinity are processed in pushed order
+  // but ones with different affinity might be processed concurrently
+  // (synchronized with kingtaker filesystem but not with sub())
+  // returns sub() if the parallel sub execution is disabled
+  static Queue& sub(size_t affinity) noexcept;
+
   // tasks are done in thread independent completely from kingtaker filesystem
   static Queue& cpu() noexcept;
 
@@ -105,6 +226,13 @@ class Queue {
   Queue& operator=(Queue&&) = delete;
 
   virtual void Push(Task&&) noexcept = 0;
+
+  // pushes the task into this queue at the time from a timer thread
+  // (in microsecond resolution)
+  void PushAt(std::chrono::steady_clock::time_point, Task&&) noexcept;
+  void PushAfter(std::chrono::steady_clock::duration d, Task&& task) noexcept {
+    PushAt(std::chrono::steady_clock::now()+d, std::move(task));
+  }
 };
 
 
@@ -112,6 +240,7 @@ class File {
  public:
   class TypeInfo;
   class Path;
+  class ResolvedPath;
   class Env;
   class Event;
 
@@ -132,11 +261,24 @@ class File {
   static File& root() noexcept;
   static const Registry& registry() noexcept;
 
+  // requests GUI to update soon or after the duration even if it's idle
+  // (thread-safe)
+  // Only the earliest delayed request is kept, so files needing periodic
+  // updates should request again on each update.
+  static void RequestRedraw(std::chrono::steady_clock::duration after = {}) noexcept;
+
+  // changes when any file is moved or deleted (thread-safe)
+  static uint64_t generation() noexcept {
+    return generation_.load(std::memory_order_acquire);
+  }
+
   File(const TypeInfo* type, Env* env, Time lastmod = Clock::now()) noexcept :
       type_(type), env_(env), lastmod_(lastmod) {
   }
   File() = delete;
-  virtual ~File() = default;
+  virtual ~File() noexcept {
+    generation_.fetch_add(1, std::memory_order_release);
+  }
   File(const File&) = delete;
   File(File&&) = delete;
   File& operator=(const File&) = delete;
@@ -182,6 +324,9 @@ class File {
   const std::string& name() const noexcept { return name_; }
 
  private:
+  // incremented when any file is moved or deleted, to invalidate ResolvedPath
+  static inline std::atomic<uint64_t> generation_ = 1;
+
   const TypeInfo* type_;
 
   Env* env_;
@@ -291,6 +436,76 @@ class File::Path final {
   std::vector<std::string> terms_;
 };
 
+// A path that remembers the file resolved last time. While no file is moved or
+// deleted, resolving it again from the same base costs a few atomic loads.
+// Resolve() is thread-safe but assignment is not.
+class File::ResolvedPath final {
+ public:
+  ResolvedPath() = default;
+  ResolvedPath(std::string_view p) noexcept : path_(Path::Parse(p)) {
+  }
+  ResolvedPath(Path p) noexcept : path_(std::move(p)) {
+  }
+  ResolvedPath(const ResolvedPath& src) noexcept : path_(src.path_) {
+  }
+  ResolvedPath& operator=(const ResolvedPath& src) noexcept {
+    path_ = src.path_;
+    gen_.store(0, std::memory_order_relaxed);
+    return *this;
+  }
+
+  // Returns a file specified by the path relative to base or throws NotFoundException.
+  File& Resolve(const File& base) const {
+    const auto gen = generation_.load(std::memory_order_acquire);
+    if (auto ret = Find(base, gen)) return *ret;
+
+    auto ret = &base.Resolve(path_);
+    Store(base, ret, gen);
+    return *ret;
+  }
+
+  const Path& path() const noexcept { return path_; }
+
+ private:
+  Path path_;
+
+  // The cache is guarded by a seqlock: seq_ is odd while being written and
+  // readers retry by resolving when it changed during their read.
+  mutable std::atomic<uint64_t> seq_ = 0;
+
+  mutable std::atomic<const File*> base_ = nullptr;
+  mutable std::atomic<File*>       file_ = nullptr;
+  mutable std::atomic<uint64_t>    gen_  = 0;
+
+
+  File* Find(const File& base, uint64_t gen) const noexcept {
+    const auto seq = seq_.load(std::memory_order_acquire);
+    if (seq & 1) return nullptr;
+
+    const auto b = base_.load(std::memory_order_relaxed);
+    const auto f = file_.load(std::memory_order_relaxed);
+    const auto g = gen_.load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq != seq_.load(std::memory_order_relaxed)) return nullptr;
+    return g == gen && b == &base? f: nullptr;
+  }
+  void Store(const File& base, File* f, uint64_t gen) const noexcept {
+    // another thread writing the cache wins, nobody waits for it
+    auto seq = seq_.load(std::memory_order_relaxed);
+    if ((seq & 1) || !seq_.compare_exchange_strong(seq, seq+1, std::memory_order_relaxed)) {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    base_.store(&base, std::memory_order_relaxed);
+    file_.store(f, std::memory_order_relaxed);
+    gen_.store(gen, std::memory_order_relaxed);
+
+    seq_.store(seq+2, std::memory_order_release);
+  }
+};
+
 class File::Env final {
  public:
   enum Flag : uint8_t {
@@ -22,7 +22,7 @@ class Passthru final : public File, public iface::Node {
       {typeid(iface::Node)});
 
   Passthru(Env* env) noexcept :
-      File(&kType, env), Node(kNone),
+      File(&kType, env), Node(kReentrant),
       sock_out_(this, "out"),
       sock_in_(this, "in", [this](auto& ctx, auto&& v) { sock_out_.Send(ctx, std::move(v)); }) {
     out_ = {&sock_out_};
@@ -76,7 +76,7 @@ class Await final : public File, public iface::Node {
   static constexpr size_t kMaxIn = 16;
 
   Await(Env* env) noexcept :
-      File(&kType, env), Node(kNone), sock_out_(this, "out") {
+      File(&kType, env), Node(kReentrant), sock_out_(this, "out") {
     out_.push_back(&sock_out_);
 
     in_.resize(kMaxIn);
@@ -108,6 +108,11 @@ class Await final : public File, public iface::Node {
  private:
   class ContextData final : public Context::Data {
    public:
+    bool Reset(const std::shared_ptr<Context>&) noexcept override {
+      recv.fill(false);
+      return true;
+    }
+
     std::array<bool, kMaxIn> recv;
   };
 
@@ -225,11 +230,19 @@ class SetAndGet final : public LambdaNodeDriver {
     { "null", "" },
   };
 
+  static constexpr Node::Flags kFlags = Node::kReentrant;
+
   SetAndGet() = delete;
   SetAndGet(Owner* o, const std::weak_ptr<Context>& ctx) noexcept :
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_   = ctx;
+    value_ = std::nullopt;
+    return true;
+  }
+
   std::string title() const noexcept {
     if (value_) {
       return "SETnGET*";
@@ -281,11 +294,19 @@ class Once final : public LambdaNodeDriver {
     { "out", "" },
   };
 
+  static constexpr Node::Flags kFlags = Node::kReentrant;
+
   Once() = delete;
   Once(Owner* o, const std::weak_ptr<Context>& ctx) noexcept :
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_       = ctx;
+    triggered_ = false;
+    return true;
+  }
+
   std::string title() const noexcept {
     return triggered_? "ONCE*": "ONCE";
   }
@@ -18,6 +18,7 @@
 
 #include "iface/node.hh"
 
+#include "util/coroutine.hh"
 #include "util/gui.hh"
 #include "util/luajit.hh"
 #include "util/node.hh"
@@ -54,6 +55,12 @@ class Compile final : public LambdaNodeDriver {
       owner_(o), ctx_(ctx) {
   }
 
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    ctx_ = ctx;
+    Clear();
+    return true;
+  }
+
   std::string title() const noexcept {
     return "LuaJIT Compile";
   }
@@ -130,7 +137,7 @@ class Exec final : public File, public iface::Node {
     auto task_func = [this](auto& ctx, auto&& v) {
       try {
         auto cdata = ctx->template data<ContextData>(this);
-        cdata->func = v.template dataPtr<luajit::Obj>();
+        cdata->func.Set(v.template dataPtr<luajit::Obj>());
       } catch (Exception& e) {
         NodeLoggerTextItem::Error(abspath(), *ctx, e.msg());
       }
@@ -139,7 +146,11 @@ class Exec final : public File, public iface::Node {
 
     auto task_send = [this](auto& ctx, auto&& v) {
       try {
-        ContextData::Send(ctx->template data<ContextData>(this), std::move(v));
+        auto cdata = ctx->template data<ContextData>(this);
+        ContextData::Send(cdata, std::move(v)).Start(
+            [wcdata = std::weak_ptr(cdata)](auto e) {
+              if (auto cdata = wcdata.lock()) cdata->Catch(e);
+            });
       } catch (Exception& e) {
         NodeLoggerTextItem::Error(abspath(), *ctx, e.msg());
       }
@@ -178,21 +189,25 @@ class Exec final : public File, public iface::Node {
 
   class ContextData final : public Context::Data {
    public:
-    static void Send(std::shared_ptr<ContextData> cdata, Value&& v) {
-      auto func = cdata->func;
-      if (!func) throw Exception("func is not specified");
-
-      auto ctx  = cdata->ctx();
-      auto task = [ctx, cdata, func, v = std::move(v)](auto L) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, func->reg());
-        dev_.PushValue(L, v);
-        Push(L, cdata);
-        if (dev_.SandboxCall(L, 2, 0) != 0) {
-          NodeLoggerTextItem::Error(
-              cdata->path_, *ctx, "lua execution error: "s+lua_tostring(L, -1));
-        }
-      };
-      dev_.Queue(std::move(task));
+    // values sent before func are kept in suspended frames until func comes,
+    // and the frames are released without execution when the context dies
+    static Coroutine Send(std::weak_ptr<ContextData> wcdata, Value v) {
+      auto func = co_await FuncLatch::Wait(wcdata, &ContextData::func);
+      if (!func) co_return;
+
+      auto cdata = wcdata.lock();
+      if (!cdata) co_return;
+
+      auto ctx = cdata->ctx();
+      auto L   = co_await dev_.Enter();
+
+      lua_rawgeti(L, LUA_REGISTRYINDEX, (*func)->reg());
+      dev_.PushValue(L, v);
+      Push(L, cdata);
+      if (dev_.SandboxCall(L, 2, 0) != 0) {
+        NodeLoggerTextItem::Error(
+            cdata->path_, *ctx, "lua execution error: "s+lua_tostring(L, -1));
+      }
     }
 
     static void Push(lua_State* L, const std::shared_ptr<ContextData>& cdata) {
@@ -243,7 +258,16 @@ class Exec final : public File, public iface::Node {
       return ret;
     }
 
-    std::shared_ptr<luajit::Obj> func;
+    void Catch(std::exception_ptr e) const {
+      try {
+        std::rethrow_exception(e);
+      } catch (Exception& e) {
+        if (auto ctx = ctx_.lock()) NodeLoggerTextItem::Error(path_, *ctx, e.msg());
+      }
+    }
+
+    using FuncLatch = CoroutineLatch<std::shared_ptr<luajit::Obj>>;
+    FuncLatch func;
 
    private:
     Exec* owner_;
@@ -1,11 +1,21 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <GL/glew.h>
 
@@ -16,9 +26,14 @@
 
 #include "kingtaker.hh"
 
+#include "iface/logger.hh"
+#include "iface/node.hh"
+
 #include "util/gl.hh"
 #include "util/gui.hh"
 #include "util/queue.hh"
+#include "util/tracer.hh"
+#include "util/value.hh"
 
 // To prevent conflicts because of fucking windows.h, include GLFW last.
 #include <GLFW/glfw3.h>
@@ -34,30 +49,350 @@ using namespace kingtaker;
 constexpr const char*           kFileName    = "kingtaker.bin";
 constexpr size_t                kSubTaskUnit = 100;
 constexpr std::chrono::duration kFrameDur    = 1000ms / 30;
+constexpr float                 kSubBudget   = .25f;  // ratio to kFrameDur
+constexpr std::chrono::duration kHeadlessPoll = 10ms;
+constexpr float                 kHandoffWait  = .5f;  // ratio to kFrameDur
+
+// GUI sleeps after kActiveFrames frames without input, task or redraw request,
+// and wakes up at least once in kIdleDur
+constexpr size_t                kActiveFrames = 30;
+constexpr std::chrono::duration kIdleDur      = 1s;
+
+
+// Sizes each batch of sub tasks to fit in a slice of kFrameDur,
+// measuring the cost of tasks while running them.
+class SubTaskScheduler final {
+ public:
+  using Dur = std::chrono::nanoseconds;
+
+  static constexpr size_t kMaxBatch = 1000000;
+  static constexpr double kAlpha    = .2;  // smoothing factor of the cost
+
+  SubTaskScheduler(float ratio = kSubBudget) noexcept : ratio_(ratio) {
+  }
+
+  void Record(size_t n, Dur took) noexcept {
+    if (n == 0) return;
+    last_batch_   = n;
+    last_latency_ = took.count();
+
+    const auto cost = static_cast<double>(took.count())/static_cast<double>(n);
+    const auto prev = cost_.load();
+    cost_ = prev > 0? prev*(1-kAlpha) + cost*kAlpha: cost;
+  }
+
+  // Returns a number of tasks expected to be done in the budget.
+  size_t batch() const noexcept {
+    const auto cost = cost_.load();
+    if (cost <= 0) return kSubTaskUnit;
+
+    const auto n = static_cast<double>(budget().count()) / cost;
+    return std::clamp(static_cast<size_t>(n), size_t {1}, kMaxBatch);
+  }
+  Dur budget() const noexcept {
+    const auto frame = std::chrono::duration_cast<Dur>(kFrameDur).count();
+    return Dur(static_cast<Dur::rep>(static_cast<float>(frame)*ratio_));
+  }
+  // Returns an estimated time to finish n tasks.
+  Dur Estimate(size_t n) const noexcept {
+    return Dur(static_cast<Dur::rep>(cost_*static_cast<double>(n)));
+  }
+
+  void set_ratio(float v) noexcept { ratio_ = std::clamp(v, .01f, 1.f); }
+  float ratio() const noexcept { return ratio_; }
+
+  Dur cost() const noexcept { return Dur(static_cast<Dur::rep>(cost_.load())); }
+  Dur lastLatency() const noexcept { return Dur(last_latency_.load()); }
+  size_t lastBatch() const noexcept { return last_batch_; }
+
+ private:
+  std::atomic<float> ratio_;
+
+  std::atomic<double> cost_ = 0;  // nanoseconds per task
+
+  std::atomic<size_t>   last_batch_   = 0;
+  std::atomic<Dur::rep> last_latency_ = 0;
+};
+
+
+// Measures how many sub workers run batches at the same time,
+// to see whether the shards actually run in parallel.
+class SubConcurrency final {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  class Scope final {
+   public:
+    Scope(SubConcurrency& c) noexcept : c_(&c) { c_->Enter(); }
+    ~Scope() noexcept { c_->Leave(); }
+    Scope(const Scope&) = delete;
+    Scope(Scope&&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    Scope& operator=(Scope&&) = delete;
+
+   private:
+    SubConcurrency* c_;
+  };
+
+  // average number of busy workers while any of them is busy
+  double average() const noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    return any_.count()? weighted_/static_cast<double>(any_.count()): 0.;
+  }
+  size_t peak() const noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    return peak_;
+  }
+
+ private:
+  mutable std::mutex mtx_;
+
+  size_t busy_ = 0, peak_ = 0;
+
+  Clock::time_point last_;
+  Clock::duration   any_ = Clock::duration::zero();
+  double            weighted_ = 0;  // sum of busy workers x ticks
+
+
+  void Enter() noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    Advance();
+    peak_ = std::max(peak_, ++busy_);
+  }
+  void Leave() noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    Advance();
+    --busy_;
+  }
+  void Advance() noexcept {
+    const auto now = Clock::now();
+    if (busy_) {
+      const auto d = now - last_;
+      any_     += d;
+      weighted_ += static_cast<double>(busy_)*static_cast<double>(d.count());
+    }
+    last_ = now;
+  }
+};
+
+
+// Counts wakeups of the GUI or headless thread, to see what the app costs
+// while nothing happens. An idle GUI should wake about once per kIdleDur.
+class WakeupMeter final {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr auto kWindow = std::chrono::seconds(1);
+
+  // idle is true when the thread has woken from a sleep for idle
+  void Count(Clock::time_point now, bool idle) noexcept {
+    ++total_, ++window_;
+    if (idle) ++idle_total_, ++idle_window_;
+
+    const auto dur = now - begin_;
+    if (dur >= kWindow) {
+      const auto sec = std::chrono::duration<float>(dur).count();
+      rate_      = static_cast<float>(window_)/sec;
+      idle_rate_ = static_cast<float>(idle_window_)/sec;
+      window_ = 0, idle_window_ = 0;
+      begin_  = now;
+    }
+  }
+
+  // per second in the last window
+  float rate() const noexcept { return rate_; }
+  float idleRate() const noexcept { return idle_rate_; }
+
+  size_t total() const noexcept { return total_; }
+  size_t idleTotal() const noexcept { return idle_total_; }
+  float elapsed() const noexcept {
+    return std::chrono::duration<float>(Clock::now()-epoch_).count();
+  }
+
+ private:
+  Clock::time_point epoch_ = Clock::now();
+  Clock::time_point begin_ = epoch_;
+
+  size_t total_ = 0, idle_total_ = 0;
+  size_t window_ = 0, idle_window_ = 0;
+
+  float rate_ = 0, idle_rate_ = 0;
+};
+
 
+// A lock that synchronizes threads with kingtaker filesystem.
+// The GUI update and main worker take it exclusively and the sub shard workers
+// take it shared. Exclusive lockers are preferred to keep the GUI responsive.
+class FileSystemMutex final {
+ public:
+  void lock() noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    ++waiters_;
+    cv_.wait(k, [this]() { return !writer_ && readers_ == 0; });
+    --waiters_;
+    writer_ = true;
+  }
+  bool try_lock() noexcept {
+    std::unique_lock<std::mutex> _(mtx_);
+    if (writer_ || readers_ > 0) return false;
+    writer_ = true;
+    return true;
+  }
+  template <typename T>
+  bool try_lock_until(const T& t) noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    ++waiters_;
+    const bool ok = cv_.wait_until(k, t, [this]() { return !writer_ && readers_ == 0; });
+    --waiters_;
+    if (ok) {
+      writer_ = true;
+    } else if (waiters_ == 0) {
+      // readers blocked by this waiter can go
+      k.unlock();
+      cv_.notify_all();
+    }
+    return ok;
+  }
+  void unlock() noexcept {
+    {
+      std::unique_lock<std::mutex> _(mtx_);
+      writer_ = false;
+    }
+    cv_.notify_all();
+  }
+
+  void lock_shared() noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    cv_.wait(k, [this]() { return !writer_ && waiters_ == 0; });
+    ++readers_;
+  }
+  void unlock_shared() noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    if (--readers_ == 0) {
+      k.unlock();
+      cv_.notify_all();
+    }
+  }
 
-static std::mutex              main_mtx_;
-static std::condition_variable main_cv_;
-static std::thread             main_worker_;
-static std::atomic<bool>       main_alive_ = true;
+ private:
+  std::mutex              mtx_;
+  std::condition_variable cv_;
+
+  bool   writer_  = false;
+  size_t readers_ = 0;
+  size_t waiters_ = 0;
+};
+
+
+static FileSystemMutex             main_mtx_;
+static std::condition_variable_any main_cv_;
+static std::thread                 main_worker_;
+static std::atomic<bool>           main_alive_ = true;
+
+// notified when the main worker empties mainq_
+static std::mutex              handoff_mtx_;
+static std::condition_variable handoff_cv_;
 
 static std::mutex  panic_mtx_;
 static std::string panic_;
 
-static SimpleQueue mainq_;
-static SimpleQueue subq_;
-static SimpleQueue glq_;
-static CpuQueue    cpuq_(2);
+// GUI thread is sleeping in glfwWaitEventsTimeout()
+static std::atomic<bool>   gui_idle_  = false;
+static std::atomic<bool>   redraw_    = false;
+static std::atomic<size_t> input_cnt_ = 0;
+
+// the earliest delayed redraw request in steady_clock ticks
+using RedrawClock = std::chrono::steady_clock;
+constexpr auto kNoRedraw = RedrawClock::duration::max().count();
+static std::atomic<RedrawClock::rep> redraw_at_ = kNoRedraw;
+
+// touched only by the GUI or headless thread
+static WakeupMeter wakeups_;
+
+// the headless thread sleeps instead of GUI until any queue gets a task
+static std::atomic<bool>       headless_ = false;
+static std::mutex              headless_mtx_;
+static std::condition_variable headless_cv_;
+static bool                    headless_wake_ = false;  // guarded by headless_mtx_
+
+void WakeUpGui() noexcept {
+  if (headless_) {
+    {
+      std::unique_lock<std::mutex> _(headless_mtx_);
+      headless_wake_ = true;
+    }
+    headless_cv_.notify_one();
+    return;
+  }
+  if (gui_idle_) glfwPostEmptyEvent();
+}
+void File::RequestRedraw(RedrawClock::duration after) noexcept {
+  if (after <= RedrawClock::duration::zero()) {
+    redraw_ = true;
+    WakeUpGui();
+    return;
+  }
+  const auto t = (RedrawClock::now()+after).time_since_epoch().count();
+
+  auto cur = redraw_at_.load();
+  while (t < cur) {
+    if (redraw_at_.compare_exchange_weak(cur, t)) {
+      WakeUpGui();  // to shorten the sleep
+      return;
+    }
+  }
+}
+
+static SimpleQueue             mainq_("main", WakeUpGui);
+static SimpleQueue             subq_("sub", WakeUpGui);
+static SimpleQueue             glq_("gl", WakeUpGui);
+static std::optional<CpuQueue> cpuq_;
+
+// for the main worker, and each shard has its own
+static SubTaskScheduler subsched_;
+static SubConcurrency   subconc_;
+
+// sub queues for each shard of contexts, which are empty if parallel sub
+// execution is disabled
+static std::vector<std::unique_ptr<SimpleQueue>>      subshards_;
+static std::vector<std::unique_ptr<SubTaskScheduler>> subshard_scheds_;
+static std::vector<std::thread>                       subshard_workers_;
+
 Queue& Queue::main() noexcept { return mainq_; }
 Queue& Queue::sub() noexcept { return subq_; }
-Queue& Queue::cpu() noexcept { return cpuq_; }
+Queue& Queue::sub(size_t affinity) noexcept {
+  if (subshards_.empty()) return subq_;
+  return *subshards_[affinity%subshards_.size()];
+}
+Queue& Queue::cpu() noexcept { return *cpuq_; }
 Queue& Queue::gl() noexcept { return glq_; }
 
+static TimerWheel timer_;
+void Queue::PushAt(std::chrono::steady_clock::time_point t, Task&& task) noexcept {
+  timer_.Push(t, *this, std::move(task));
+}
+
 File::Env env_(std::filesystem::current_path(), File::Env::kRoot);
 
 static std::unique_ptr<File> root_;
 File& File::root() noexcept { return *root_; }
 
+struct {
+  // 0 means the number of hardware threads
+  size_t cpu_threads = 0;
+
+  float sub_budget = kSubBudget;
+
+  // 1 disables parallel sub execution
+  size_t sub_workers = 1;
+
+  // runs without GLFW and ImGui
+  bool headless = false;
+
+  // entry points that receive a pulse in headless mode (path and socket name)
+  std::vector<std::pair<std::string, std::string>> emits;
+} config_;
+
 struct {
   File::Event::Status st = File::Event::kNone;
   std::unordered_set<File*> focus;
@@ -79,24 +414,57 @@ class Event final : public File::Event {
 };
 
 
+bool ParseArgs(int, char**) noexcept;
 void InitKingtaker() noexcept;
 
 void Update()        noexcept;
 bool UpdatePanic()   noexcept;
 void UpdateAppMenu() noexcept;
+void UpdateSubSchedulerMenu() noexcept;
 void Save()          noexcept;
 
 void Panic(const std::string&) noexcept;
 std::string GenerateSystemInfoFullText() noexcept;
 
 void WorkerMain() noexcept;
+void SubShardMain(SimpleQueue&, SubTaskScheduler&) noexcept;
+bool HandOff(std::unique_lock<FileSystemMutex>&, Time) noexcept;
+void NotifyHandOff() noexcept;
+
+int  HeadlessMain() noexcept;
+bool EmitPulse(const std::string&, const std::string&) noexcept;
+bool IsIdle() noexcept;
+
 
+int main(int argc, char** argv) {
+  if (!ParseArgs(argc, argv)) return 1;
+  subsched_.set_ratio(config_.sub_budget);
+
+  // starts CPU workers
+  cpuq_.emplace(config_.cpu_threads?
+                config_.cpu_threads: std::thread::hardware_concurrency());
+
+  headless_ = config_.headless;
 
-int main(int, char**) {
   // starts main worker
   main_alive_ = true;
   main_worker_ = std::thread(WorkerMain);
 
+  // starts sub shard workers
+  if (config_.sub_workers > 1) {
+    subshards_.resize(config_.sub_workers);
+    subshard_scheds_.resize(config_.sub_workers);
+    for (size_t i = 0; i < subshards_.size(); ++i) {
+      auto& q     = subshards_[i];
+      auto& sched = subshard_scheds_[i];
+      q     = std::make_unique<SimpleQueue>("sub#"+std::to_string(i), WakeUpGui);
+      sched = std::make_unique<SubTaskScheduler>(config_.sub_budget);
+      subshard_workers_.emplace_back(SubShardMain, std::ref(*q), std::ref(*sched));
+    }
+  }
+  if (config_.headless) return HeadlessMain();
+  Tracer::NameThread("gui");
+
   // init display
   glfwSetErrorCallback(
       [](int, const char* msg) {
@@ -135,6 +503,25 @@ int main(int, char**) {
   io.IniFilename  = nullptr;
   io.ConfigFlags |= ImGuiConfigFlags_DockingEnable;
 
+  // counts input events to detect activity,
+  // ImGui chains these callbacks so they must be set before its init
+  glfwSetKeyCallback(
+      window, [](GLFWwindow*, int, int, int, int) { ++input_cnt_; });
+  glfwSetCharCallback(
+      window, [](GLFWwindow*, unsigned int) { ++input_cnt_; });
+  glfwSetMouseButtonCallback(
+      window, [](GLFWwindow*, int, int, int) { ++input_cnt_; });
+  glfwSetCursorPosCallback(
+      window, [](GLFWwindow*, double, double) { ++input_cnt_; });
+  glfwSetScrollCallback(
+      window, [](GLFWwindow*, double, double) { ++input_cnt_; });
+  glfwSetWindowFocusCallback(
+      window, [](GLFWwindow*, int) { ++input_cnt_; });
+  glfwSetFramebufferSizeCallback(
+      window, [](GLFWwindow*, int, int) { ++input_cnt_; });
+  glfwSetWindowRefreshCallback(
+      window, [](GLFWwindow*) { ++input_cnt_; });
+
   ImGui::StyleColorsDark();
   ImGui_ImplGlfw_InitForOpenGL(window, true);
   ImGui_ImplOpenGL3_Init(glsl_version);
@@ -144,33 +531,72 @@ int main(int, char**) {
   glfwShowWindow(window);
 
   // main loop
-  bool alive = true;
+  bool   alive  = true;
+  size_t active = kActiveFrames;
+
+  size_t last_input = 0, last_pushed = 0;
   while (alive) {
+    // sleep until input, queued task or redraw request while idle
+    const bool idle = active == 0;
+    if (idle) {
+      gui_idle_ = true;
+      if (!redraw_ && !mainq_.pending() && !subq_.pending() && !glq_.pending()) {
+        const auto at    = RedrawClock::time_point(RedrawClock::duration(redraw_at_.load()));
+        const auto sleep = std::clamp<RedrawClock::duration>(
+            at-RedrawClock::now(), RedrawClock::duration::zero(), kIdleDur);
+        glfwWaitEventsTimeout(std::chrono::duration<double>(sleep).count());
+      }
+      gui_idle_ = false;
+    }
     const auto t = Clock::now();
+    wakeups_.Count(WakeupMeter::Clock::now(), idle);
+
+    // a delayed redraw request is due
+    if (auto at = redraw_at_.load();
+        at <= RedrawClock::now().time_since_epoch().count() &&
+        redraw_at_.compare_exchange_strong(at, kNoRedraw)) {
+      redraw_ = true;
+    }
 
     // new frame
     if (next_.st & File::Event::kClosed) alive = false;
     glfwPollEvents();
-    ImGui_ImplOpenGL3_NewFrame();
-    ImGui_ImplGlfw_NewFrame();
-    ImGui::NewFrame();
 
-    {
-      std::unique_lock<std::mutex> k(main_mtx_);
-      main_cv_.wait(k, []() { return !mainq_.pending(); });
-      Update();
-      main_cv_.notify_one();
+    // any input or task keeps the full frame rate for a while
+    size_t pushed = 0;
+    for (auto st : QueueStats::instances()) pushed += st->pushed();
+
+    const auto input = input_cnt_.load();
+    if (redraw_.exchange(false) || input != last_input || pushed != last_pushed) {
+      active = kActiveFrames;
+    } else if (active > 0) {
+      --active;
     }
+    last_input  = input;
+    last_pushed = pushed;
 
-    // render windows
-    ImGui::Render();
+    // update GUI only when the main worker hands the filesystem off in time,
+    // otherwise the last frame is rendered again
+    {
+      std::unique_lock<FileSystemMutex> k(main_mtx_, std::defer_lock);
+      if (HandOff(k, t + std::chrono::duration_cast<Clock::duration>(kFrameDur*kHandoffWait))) {
+        ImGui_ImplOpenGL3_NewFrame();
+        ImGui_ImplGlfw_NewFrame();
+        ImGui::NewFrame();
+        Update();
+        ImGui::Render();
+      }
+    }
+    main_cv_.notify_one();
 
     int w, h;
     glfwGetFramebufferSize(window, &w, &h);
     glViewport(0, 0, w, h);
 
     glClear(GL_COLOR_BUFFER_BIT);
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    if (auto dd = ImGui::GetDrawData(); dd && dd->Valid) {
+      ImGui_ImplOpenGL3_RenderDrawData(dd);
+    }
 
     glfwSwapBuffers(window);
 
@@ -189,6 +615,7 @@ int main(int, char**) {
   // request main worker to exit
   main_alive_ = false;
   main_cv_.notify_one();
+  for (auto& q : subshards_) q->Wake();
 
   // teardown ImGUI
   ImGui_ImplOpenGL3_Shutdown();
@@ -202,11 +629,65 @@ int main(int, char**) {
 
   // teardown system
   main_worker_.join();
+  for (auto& th : subshard_workers_) th.join();
   root_ = nullptr;
   return 0;
 }
 
 
+bool ParseArgs(int argc, char** argv) noexcept {
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg.starts_with("--cpu-threads=")) {
+      const auto v = arg.substr(arg.find('=')+1);
+      const auto [ptr, ec] =
+          std::from_chars(v.data(), v.data()+v.size(), config_.cpu_threads);
+      if (ec != std::errc() || ptr != v.data()+v.size()) {
+        std::cerr << "invalid thread count: " << v << std::endl;
+        return false;
+      }
+    } else if (arg.starts_with("--sub-workers=")) {
+      const auto v = arg.substr(arg.find('=')+1);
+      const auto [ptr, ec] =
+          std::from_chars(v.data(), v.data()+v.size(), config_.sub_workers);
+      if (ec != std::errc() || ptr != v.data()+v.size() || config_.sub_workers == 0) {
+        std::cerr << "invalid sub worker count: " << v << std::endl;
+        return false;
+      }
+    } else if (arg.starts_with("--sub-budget=")) {
+      // percentage of a frame that sub tasks can take at once
+      const auto v = arg.substr(arg.find('=')+1);
+      size_t percent;
+      const auto [ptr, ec] =
+          std::from_chars(v.data(), v.data()+v.size(), percent);
+      if (ec != std::errc() || ptr != v.data()+v.size() ||
+          percent == 0 || percent > 100) {
+        std::cerr << "invalid sub budget: " << v << std::endl;
+        return false;
+      }
+      config_.sub_budget = static_cast<float>(percent)/100.f;
+    } else if (arg == "--headless") {
+      config_.headless = true;
+    } else if (arg.starts_with("--emit=")) {
+      // --emit=/path/to/node:socket
+      const auto v   = arg.substr(arg.find('=')+1);
+      const auto sep = v.rfind(':');
+      if (sep == std::string_view::npos || sep == 0 || sep+1 == v.size()) {
+        std::cerr << "invalid entry point (expected PATH:SOCKET): " << v << std::endl;
+        return false;
+      }
+      config_.emits.emplace_back(v.substr(0, sep), v.substr(sep+1));
+    } else {
+      std::cerr << "unknown option: " << arg << std::endl;
+      return false;
+    }
+  }
+  if (config_.emits.size() && !config_.headless) {
+    std::cerr << "--emit is available only in headless mode" << std::endl;
+    return false;
+  }
+  return true;
+}
 void InitKingtaker() noexcept {
   const auto config = env_.npath() / kFileName;
   if (!std::filesystem::exists(config)) {
@@ -326,6 +807,19 @@ void UpdateAppMenu() noexcept {
         ImGui::EndMenu();
       }
 
+      if (ImGui::BeginMenu("sub scheduler")) {
+        UpdateSubSchedulerMenu();
+        ImGui::EndMenu();
+      }
+
+      ImGui::MenuItem("wakeups");
+      if (ImGui::IsItemHovered()) {
+        ImGui::BeginTooltip();
+        ImGui::Text("frames     : %.1f /s", wakeups_.rate());
+        ImGui::Text("while idle : %.1f /s", wakeups_.idleRate());
+        ImGui::EndTooltip();
+      }
+
       ImGui::MenuItem("system");
       if (ImGui::IsItemHovered()) {
         ImGui::BeginTooltip();
@@ -343,6 +837,36 @@ void UpdateAppMenu() noexcept {
     ImGui::EndMainMenuBar();
   }
 }
+void UpdateSubSchedulerMenu() noexcept {
+  const auto us = [](auto d) {
+    return std::chrono::duration<float, std::micro>(d).count();
+  };
+  const auto backlog = subq_.size();
+
+  ImGui::Text("budget     : %.1f us", us(subsched_.budget()));
+  ImGui::Text("task cost  : %.3f us", us(subsched_.cost()));
+  ImGui::Text("batch size : %zu (last: %zu)", subsched_.batch(), subsched_.lastBatch());
+  ImGui::Text("latency    : %.1f us", us(subsched_.lastLatency()));
+  ImGui::Text("backlog    : %zu tasks (%.1f us)", backlog, us(subsched_.Estimate(backlog)));
+
+  for (size_t i = 0; i < subshard_scheds_.size(); ++i) {
+    const auto& sched = *subshard_scheds_[i];
+    ImGui::Text("shard #%zu   : %.3f us x %zu", i, us(sched.cost()), sched.batch());
+  }
+  if (subshards_.size()) {
+    ImGui::Text("concurrency: %.2f avg, %zu peak", subconc_.average(), subconc_.peak());
+    if (ImGui::IsItemHovered()) {
+      ImGui::SetTooltip("number of sub workers running tasks at the same time");
+    }
+  }
+
+  ImGui::Separator();
+  float percent = subsched_.ratio()*100.f;
+  if (ImGui::SliderFloat("##budget", &percent, 1.f, 100.f, "%.0f%% of frame")) {
+    subsched_.set_ratio(percent/100.f);
+    for (auto& sched : subshard_scheds_) sched->set_ratio(percent/100.f);
+  }
+}
 void Save() noexcept {
   next_.st |= File::Event::kSaved;
 
@@ -365,6 +889,7 @@ void Save() noexcept {
 void Panic(const std::string& msg) noexcept {
   std::unique_lock<std::mutex> k(panic_mtx_);
   panic_ += msg + "\n\n####\n\n";
+  if (config_.headless) std::cerr << "PANIC: " << msg << std::endl;
 }
 std::string GenerateSystemInfoFullText() noexcept {
   std::string ret =
@@ -378,7 +903,9 @@ std::string GenerateSystemInfoFullText() noexcept {
 }
 
 void WorkerMain() noexcept {
-  std::unique_lock<std::mutex> k(main_mtx_);
+  Tracer::NameThread("main worker");
+
+  std::unique_lock<FileSystemMutex> k(main_mtx_);
   while (main_alive_) {
     if (!k) k.lock();
 
@@ -390,13 +917,41 @@ void WorkerMain() noexcept {
     try {
       // empty mainq_ firstly
       while (mainq_.Pop());
-      main_cv_.notify_one();
+      NotifyHandOff();
+
+      // sub() is not synchronized with shards, so the filesystem is shared
+      // with them while running its tasks, instead of stopping them all
+      if (subshards_.size()) {
+        k.unlock();
+        std::shared_lock<FileSystemMutex> sk(main_mtx_);
+        while (main_alive_ && !mainq_.pending()) {
+          const auto n  = subsched_.batch();
+          const auto t0 = std::chrono::steady_clock::now();
+
+          size_t i = 0;
+          {
+            SubConcurrency::Scope _(subconc_);
+            while (i < n && subq_.Pop()) ++i;
+          }
+          subsched_.Record(i, std::chrono::steady_clock::now()-t0);
+          if (i < n) break;
+
+          // lets the GUI update in
+          sk.unlock();
+          sk.lock();
+        }
+        continue;
+      }
 
       for (;;) {
-        // executes some tasks
+        // executes tasks as many as the budget allows
+        const auto n  = subsched_.batch();
+        const auto t0 = std::chrono::steady_clock::now();
+
         size_t i = 0;
-        while (i < kSubTaskUnit && subq_.Pop()) ++i;
-        if (i < kSubTaskUnit || !main_alive_) break;
+        while (i < n && subq_.Pop()) ++i;
+        subsched_.Record(i, std::chrono::steady_clock::now()-t0);
+        if (i < n || !main_alive_) break;
 
         // if relock fails or mainq is not empty, handle mainq again
         k.unlock();
@@ -408,3 +963,157 @@ void WorkerMain() noexcept {
     }
   }
 }
+bool HandOff(std::unique_lock<FileSystemMutex>& k, Time until) noexcept {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> hk(handoff_mtx_);
+      if (!handoff_cv_.wait_until(hk, until, []() { return !mainq_.pending(); })) {
+        return false;
+      }
+    }
+    if (!k.try_lock_until(until)) return false;
+
+    // tasks might be pushed by others while locking
+    if (!mainq_.pending()) return true;
+    k.unlock();
+    main_cv_.notify_one();
+  }
+}
+void NotifyHandOff() noexcept {
+  {
+    std::unique_lock<std::mutex> _(handoff_mtx_);
+  }
+  handoff_cv_.notify_all();
+}
+void SubShardMain(SimpleQueue& q, SubTaskScheduler& sched) noexcept {
+  Tracer::NameThread(q.stats().name().c_str());
+
+  while (main_alive_) {
+    q.Wait();
+
+    // tasks in other shards may run concurrently
+    // but the filesystem is never modified while running
+    std::shared_lock<FileSystemMutex> k(main_mtx_);
+    try {
+      while (main_alive_) {
+        const auto n  = sched.batch();
+        const auto t0 = std::chrono::steady_clock::now();
+
+        size_t i = 0;
+        {
+          SubConcurrency::Scope _(subconc_);
+          while (i < n && q.Pop()) ++i;
+        }
+        sched.Record(i, std::chrono::steady_clock::now()-t0);
+        if (i < n) break;
+
+        // lets the GUI update and main worker in
+        k.unlock();
+        k.lock();
+      }
+    } catch (Exception& e) {
+      Panic(e.Stringify());
+    }
+  }
+}
+
+
+int HeadlessMain() noexcept {
+  InitKingtaker();
+
+  bool ok = !!root_;
+  if (ok) {
+    std::unique_lock<FileSystemMutex> k(main_mtx_);
+    for (const auto& [path, sock] : config_.emits) {
+      ok = EmitPulse(path, sock) && ok;
+    }
+  }
+
+  // the main worker is usually woken up by the GUI thread on each frame,
+  // so this thread does it instead until all queues go idle
+  // (polling is for tasks on the CPU and LuaJIT threads that push nothing)
+  do {
+    {
+      std::unique_lock<std::mutex> k(headless_mtx_);
+      const bool woken = headless_cv_.wait_for(
+          k, kHeadlessPoll, []() { return headless_wake_; });
+      headless_wake_ = false;
+      wakeups_.Count(WakeupMeter::Clock::now(), !woken);
+    }
+    std::unique_lock<FileSystemMutex> k(main_mtx_);
+    main_cv_.notify_one();
+  } while (!IsIdle());
+
+  // request workers to exit
+  main_alive_ = false;
+  main_cv_.notify_one();
+  for (auto& q : subshards_) q->Wake();
+
+  main_worker_.join();
+  for (auto& th : subshard_workers_) th.join();
+
+  if (glq_.pending()) {
+    std::cerr << glq_.size() << " GL tasks are discarded" << std::endl;
+  }
+  std::cerr << "wakeups: " << wakeups_.total() << " (" << wakeups_.idleTotal() <<
+      " by polling) in " << wakeups_.elapsed() << " s" << std::endl;
+  if (subshards_.size()) {
+    std::cerr << "sub concurrency: " << subconc_.average() << " avg, " <<
+        subconc_.peak() << " peak" << std::endl;
+  }
+  {
+    std::unique_lock<std::mutex> k(panic_mtx_);
+    if (panic_.size()) ok = false;
+  }
+  root_ = nullptr;
+  return ok? 0: 1;
+}
+bool EmitPulse(const std::string& path, const std::string& sock_name) noexcept {
+  class HeadlessContext final : public iface::Node::Context {
+   public:
+    HeadlessContext(File::Path&& path) noexcept : Context(std::move(path)) {
+    }
+    void Notify(const std::shared_ptr<iface::Logger::Item>& item) noexcept override {
+      std::cerr << item->Stringify() + "\n" << std::flush;
+    }
+  };
+
+  try {
+    auto& target = root_->Resolve(path);
+
+    auto n = File::iface<iface::Node>(&target);
+    if (!n) throw Exception("target doesn't have Node interface");
+
+    auto sock = n->in(sock_name);
+    if (!sock) throw Exception("missing input socket, "+sock_name);
+
+    auto ctx = std::make_shared<HeadlessContext>(target.abspath());
+    n->Initialize(ctx);
+    sock->Receive(ctx, Value::Pulse());
+    return true;
+  } catch (Exception& e) {
+    std::cerr << path << ":" << sock_name << ": " << e.msg() << std::endl;
+    return false;
+  }
+}
+bool IsIdle() noexcept {
+  // all queues including CPU workers and the LuaJIT device are checked by
+  // their stats, but GL tasks never run without display
+  const auto gl = &glq_.stats();
+
+  // a running task or the timer may push another into a queue checked
+  // already, so it's idle only when no task is pushed while checking
+  const auto pushed = [&]() {
+    size_t n = 0;
+    for (auto st : QueueStats::instances()) {
+      if (st != gl) n += st->pushed();
+    }
+    return n;
+  };
+  const auto before = pushed();
+  if (timer_.size()) return false;
+  for (auto st : QueueStats::instances()) {
+    if (st != gl && st->active()) return false;
+  }
+  return before == pushed();
+}
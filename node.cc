@@ -4,6 +4,7 @@
 #include <cmath>
 #include <functional>
 #include <memory>
+#include <optional>
 #include <set>
 #include <string>
 #include <unordered_map>
@@ -21,14 +22,18 @@
 #include "iface/memento.hh"
 #include "iface/node.hh"
 
+#include "util/coroutine.hh"
 #include "util/gui.hh"
 #include "util/history.hh"
 #include "util/life.hh"
 #include "util/logger.hh"
 #include "util/memento.hh"
 #include "util/node.hh"
+#include "util/node_cache.hh"
 #include "util/node_logger.hh"
+#include "util/node_profiler.hh"
 #include "util/ptr_selector.hh"
+#include "util/snapshot.hh"
 #include "util/value.hh"
 
 
@@ -45,7 +50,7 @@ class Network : public File, public iface::DirItem, public iface::Node {
       {typeid(iface::DirItem)});
 
   Network(Env* env) noexcept :
-      Network(env, {}, std::make_unique<NodeLinkStore>(), false, {0, 0}, 1.f) {
+      Network(env, {}, std::make_unique<NodeLinkStore>(), false, false, {0, 0}, 1.f) {
   }
 
   Network(Env* env, const msgpack::object& obj) :
@@ -54,7 +59,7 @@ class Network : public File, public iface::DirItem, public iface::Node {
   void Serialize(Packer& pk) const noexcept override {
     std::unordered_map<Node*, size_t> idxmap;
 
-    pk.pack_map(5);
+    pk.pack_map(6);
 
     pk.pack("nodes"s);
     pk.pack_array(static_cast<uint32_t>(nodes_.size()));
@@ -70,6 +75,9 @@ class Network : public File, public iface::DirItem, public iface::Node {
     pk.pack("shown"s);
     pk.pack(shown_);
 
+    pk.pack("parallel"s);
+    pk.pack(links_->parallel());
+
     pk.pack("offset"s);
     pk.pack(std::make_tuple(canvas_.Offset.x, canvas_.Offset.y));
 
@@ -90,18 +98,19 @@ class Network : public File, public iface::DirItem, public iface::Node {
 
     return std::unique_ptr<File>(new Network(
             env, std::move(nodes), links_->Clone(nmap),
-            shown_, canvas_.Offset, canvas_.Zoom));
+            shown_, links_->parallel(), canvas_.Offset, canvas_.Zoom));
   }
 
   void Update(Event& ev) noexcept override;
   void UpdateMenu() noexcept override;
   void UpdateCanvas() noexcept;
   void UpdateCanvasMenu(const ImVec2&) noexcept;
+  void UpdateNodeProfile(const Node&) noexcept;
   template <typename T>
   void UpdateNewIO(const ImVec2& pos) noexcept;
 
   void Initialize(const std::shared_ptr<Context>& octx) noexcept override {
-    InitializeChildren(octx->CreateData<LambdaContext>(this, this, octx));
+    InitializeChildren(octx->CreateData<LambdaContext>(this, this, octx)->Share(octx));
   }
   void InitializeChildren(const std::shared_ptr<Context>& ictx) noexcept {
     for (auto& node : nodes_) {
@@ -139,6 +148,26 @@ class Network : public File, public iface::DirItem, public iface::Node {
 
   std::unordered_map<Node*, NodeHolder*> hmap_;
 
+  // slots for children to be dense
+  std::vector<size_t> free_slots_;
+  size_t              next_slot_ = 0;
+
+  // Routes across the boundary of this Network compiled from IO nodes.
+  // Sub threads read it instead of in_nodes_ and out_nodes_.
+  //
+  // Only the boundary is compiled: inner links are already pre-resolved by
+  // the snapshot index of NodeLinkStore, and the inner graph is not flattened
+  // into a topological order, because it is message-driven and may contain
+  // cycles. Nested Networks and SugarCall targets stay separate contexts,
+  // and values cross their boundaries in direct calls (OutSock::SendDirect).
+  struct Plan final {
+    // sockets of InNode to emit values received by each input
+    std::unordered_map<const InSock*, std::vector<OutSock*>> entries;
+    // output to forward values received by each socket of OutNode
+    std::unordered_map<const InSock*, OutSock*> exits;
+  };
+  SnapshotPtr<Plan> plan_ = std::make_shared<const Plan>();
+
   class EditorContext;
   std::shared_ptr<EditorContext> ctx_;
   LoggerTemporaryItemQueue logq_;
@@ -147,25 +176,33 @@ class Network : public File, public iface::DirItem, public iface::Node {
 
   std::string io_new_name_;
 
+  // the profiler overlay is shown while the session is alive
+  std::optional<NodeProfiler::Session> profiler_;
+  NodeProfiler::ReportMap              profile_;
+  NodeProfiler::Dur                    profile_max_ = NodeProfiler::Dur::zero();
+
 
   // private ctors
   Network(Env*                             env,
           NodeHolderList&&                 nodes,
           std::unique_ptr<NodeLinkStore>&& links,
           bool                             shown,
+          bool                             parallel,
           ImVec2                           offset,
           float                            zoom) noexcept :
-      File(&kType, env), DirItem(DirItem::kMenu), Node(Node::kNone),
+      File(&kType, env), DirItem(DirItem::kMenu), Node(Node::kExternal),
       nodes_(std::move(nodes)), links_(std::move(links)), shown_(shown),
       history_(this) {
     canvas_.Zoom   = zoom;
     canvas_.Offset = offset;
     canvas_.Style.NodeRounding = 0.f;
 
+    links_->SetParallel(parallel);
     for (auto& node : nodes_) {
-      node->SetUp(this);
+      node->SetUp(this, false);
       next_id_ = std::max(next_id_, node->id()+1);
     }
+    Rebuild();
 
     auto listener = [this](const auto& link) {
       auto cmd = std::make_unique<NodeLinkStore::SwapCommand>(
@@ -181,6 +218,7 @@ class Network : public File, public iface::DirItem, public iface::Node {
                 std::move(nodes.first),
                 std::make_unique<NodeLinkStore>(msgpack::find(obj, "links"s), nodes.second),
                 msgpack::find(obj, "shown"s).as<bool>(),
+                msgpack::as_if<bool>(msgpack::find(obj, "parallel"s), false),
                 msgpack::as_if<ImVec2>(msgpack::find(obj, "offset"s), {0, 0}),
                 msgpack::find(obj, "zoom"s).as<float>()) {
   } catch (msgpack::type_error&) {
@@ -206,6 +244,12 @@ class Network : public File, public iface::DirItem, public iface::Node {
   }
 
 
+  size_t AllocSlot() noexcept {
+    if (free_slots_.empty()) return next_slot_++;
+    const auto ret = free_slots_.back();
+    free_slots_.pop_back();
+    return ret;
+  }
   NodeHolder* FindHolder(Node* n) const noexcept {
     auto itr = hmap_.find(n);
     return itr != hmap_.end()? itr->second: nullptr;
@@ -260,8 +304,23 @@ class Network : public File, public iface::DirItem, public iface::Node {
   void Rebuild() noexcept {
     SyncSocks<CustomInSock>(in_nodes_, in_socks_, in_);
     SyncSocks<OutSock>(out_nodes_, out_socks_, out_);
+    Compile();
     NotifySockChange();
   }
+  void Compile() noexcept {
+    auto plan = std::make_shared<Plan>();
+    for (auto in : in_nodes_) {
+      if (auto sock = Node::in(in->name())) {
+        plan->entries[sock].push_back(&in->out(0));
+      }
+    }
+    for (auto out : out_nodes_) {
+      if (auto sock = Node::out(out->name())) {
+        plan->exits[&out->in(0)] = sock;
+      }
+    }
+    plan_.Store(std::move(plan));
+  }
 
 
   // a wrapper for node files
@@ -307,29 +366,38 @@ class Network : public File, public iface::DirItem, public iface::Node {
       return std::make_unique<NodeHolder>(file_->Clone(env), id, pos, select);
     }
 
-    void SetUp(Network* owner) noexcept {
+    // sockets of the owner are rebuilt only when IO nodes are added or removed
+    void SetUp(Network* owner, bool rebuild = true) noexcept {
       owner_ = owner;
       file_->Move(owner, std::to_string(id_));
+      node_->AssignSlot(owner->AllocSlot());
       if (owner_->ctx_) {
         node_->Initialize(owner_->ctx_);
       }
 
+      bool io = true;
       if (auto in = dynamic_cast<InNode*>(node_)) {
         owner->in_nodes_.insert(in);
       } else if (auto out = dynamic_cast<OutNode*>(node_)) {
         owner->out_nodes_.insert(out);
+      } else {
+        io = false;
       }
       owner->hmap_[node_] = this;
-      owner->Rebuild();
+      if (io && rebuild) owner->Rebuild();
     }
     void TearDown(Network* owner) noexcept {
+      bool io = true;
       if (auto in = dynamic_cast<InNode*>(node_)) {
         owner->in_nodes_.erase(in);
       } else if (auto out = dynamic_cast<OutNode*>(node_)) {
         owner->out_nodes_.erase(out);
+      } else {
+        io = false;
       }
       owner->hmap_.erase(node_);
-      owner->Rebuild();
+      owner->free_slots_.push_back(node_->slot());
+      if (io) owner->Rebuild();
 
       file_->Move(nullptr, "");
       owner_ = nullptr;
@@ -448,10 +516,17 @@ class Network : public File, public iface::DirItem, public iface::Node {
             owner_->abspath(), *octx, "editor context is not generated yet");
         return;
       }
-      auto ictx = octx->data<LambdaContext>(owner_);
-      for (auto in : owner_->in_nodes_) {
-        if (in->name() == name()) in->out(0).Send(ictx, Value(v));
+      auto plan = owner_->plan_.Load();
+      auto itr  = plan->entries.find(this);
+      if (itr == plan->entries.end()) return;
+
+      // values go to InNodes directly since the inner context shares affinity
+      auto ictx = octx->data<LambdaContext>(owner_)->Share(octx);
+      const auto& socks = itr->second;
+      for (size_t i = 0; i+1 < socks.size(); ++i) {
+        socks[i]->SendDirect(ictx, Value(v));
       }
+      socks.back()->SendDirect(ictx, std::move(v));
     }
 
    private:
@@ -462,30 +537,44 @@ class Network : public File, public iface::DirItem, public iface::Node {
 
 
   // An impl of Context to execute Network as lambda.
+  // It's kept as data of the outer context, and inner nodes take it through
+  // Share() that owns the outer one instead, so the two don't own each other
+  // and the outer context can be released or recycled by NodeContextPool.
   // Ensure Network::ctx_ is filled before creating LambdaContext
   class LambdaContext : public Context, public Context::Data {
    public:
     LambdaContext(Network* owner, const std::shared_ptr<Context>& octx) noexcept :
-        Context(Path(owner->ctx_->basepath()), octx),
-        owner_(owner), life_(owner_->life_) {
+        Context(Path(owner->ctx_->basepath()), Unowned(octx)),
+        owner_(owner), life_(owner_->life_), outer_(octx) {
+    }
+
+    bool Reset(const std::shared_ptr<Context>& octx) noexcept override {
+      if (!*life_) return false;
+      Rebind(Path(owner_->ctx_->basepath()), Unowned(octx));
+      outer_ = octx;
+      return ResetData(Share(octx));
+    }
+
+    // octx must be the outer context that has this as data
+    std::shared_ptr<Context> Share(const std::shared_ptr<Context>& octx) noexcept {
+      return std::shared_ptr<Context>(octx, this);
     }
 
     void ObserveReceive(const InSock& in, const Value& v) noexcept override {
       if (!*life_) return;
-      auto itr = owner_->out_nodes_.find(dynamic_cast<OutNode*>(in.owner()));
-      if (itr == owner_->out_nodes_.end()) return;
-
-      const auto& out_sock = owner_->out((*itr)->name());
-      if (!out_sock) return;
+      auto plan = owner_->plan_.Load();
+      auto itr  = plan->exits.find(&in);
+      if (itr == plan->exits.end()) return;
 
-      out_sock->Send(octx(), Value(v));
+      // the receiver holds this through Share(), so the outer one is alive
+      itr->second->SendDirect(outer_.lock(), Value(v));
     }
 
-    std::vector<InSock*> GetDstOf(const OutSock* out) const noexcept override {
+    SockList<InSock> GetDstOf(const OutSock* out) const noexcept override {
       if (!*life_) return {};
       return owner_->links_->GetDstOf(out);
     }
-    std::vector<OutSock*> GetSrcOf(const InSock* in) const noexcept override {
+    SockList<OutSock> GetSrcOf(const InSock* in) const noexcept override {
       if (!*life_) return {};
       return owner_->links_->GetSrcOf(in);
     }
@@ -494,6 +583,13 @@ class Network : public File, public iface::DirItem, public iface::Node {
     Network* owner_;
 
     Life::Ref life_;
+
+    std::weak_ptr<Context> outer_;
+
+
+    static std::shared_ptr<Context> Unowned(const std::shared_ptr<Context>& octx) noexcept {
+      return std::shared_ptr<Context>(std::shared_ptr<Context>(), octx.get());
+    }
   };
 
   // An impl of Node::Editor for Network
@@ -518,11 +614,11 @@ class Network : public File, public iface::DirItem, public iface::Node {
       owner_->history_.AddSilently(std::move(cmd));
     }
 
-    std::vector<InSock*> GetDstOf(const OutSock* out) const noexcept override {
+    SockList<InSock> GetDstOf(const OutSock* out) const noexcept override {
       if (!*life_) return {};
       return owner_->links_->GetDstOf(out);
     }
-    std::vector<OutSock*> GetSrcOf(const InSock* in) const noexcept override {
+    SockList<OutSock> GetSrcOf(const InSock* in) const noexcept override {
       if (!*life_) return {};
       return owner_->links_->GetSrcOf(in);
     }
@@ -641,6 +737,17 @@ void Network::Update(Event& ev) noexcept {
 }
 void Network::UpdateMenu() noexcept {
   ImGui::MenuItem("NetworkEditor", nullptr, &shown_);
+  ImGui::Separator();
+
+  bool parallel = links_->parallel();
+  if (ImGui::MenuItem("parallel fan-out", nullptr, &parallel)) {
+    links_->SetParallel(parallel);
+  }
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip(
+        "runs branches never joining again on CPU threads\n"
+        "(only ones made of nodes declared re-entrant)");
+  }
 }
 void Network::UpdateCanvas() noexcept {
   const auto pos = ImGui::GetCursorScreenPos();
@@ -648,6 +755,17 @@ void Network::UpdateCanvas() noexcept {
   ImNodes::BeginCanvas(&canvas_);
   gui::NodeCanvasSetZoom();
 
+  // collect records for the profiler overlay
+  if (profiler_) {
+    profile_     = NodeProfiler::Collect();
+    profile_max_ = NodeProfiler::Dur::zero();
+    for (auto& h : nodes_) {
+      auto itr = profile_.find(&h->node());
+      if (itr == profile_.end()) continue;
+      profile_max_ = std::max(profile_max_, itr->second.total.total);
+    }
+  }
+
   // update children
   for (auto& h : nodes_) {
     h->UpdateNode(*this);
@@ -657,17 +775,20 @@ void Network::UpdateCanvas() noexcept {
   std::vector<NodeLinkStore::SockLink> rm_links;
   for (auto& link : links_->items()) {
     auto srch = FindHolder(link.out.node);
-    auto srcs = link.out.name.c_str();
+    auto srcs = link.out.name.str().c_str();
     auto dsth = FindHolder(link.in.node);
-    auto dsts = link.in.name.c_str();
+    auto dsts = link.in.name.str().c_str();
     if (!srch || !dsth) continue;
 
     if (!ImNodes::Connection(dsth, dsts, srch, srcs)) {
       rm_links.push_back(link);
     }
   }
-  for (const auto& link : rm_links) {
-    ctx_->Unlink(*link.in.sock, *link.out.sock);
+  if (rm_links.size()) {
+    NodeLinkStore::EditScope _(*links_);
+    for (const auto& link : rm_links) {
+      ctx_->Unlink(*link.in.sock, *link.out.sock);
+    }
   }
 
   // handle new connection
@@ -725,12 +846,27 @@ void Network::UpdateCanvasMenu(const ImVec2& winpos) noexcept {
 
   ImGui::Separator();
   if (ImGui::MenuItem("Undo")) {
+    NodeLinkStore::EditScope _(*links_);
     history_.UnDo();
   }
   if (ImGui::MenuItem("Redo")) {
+    NodeLinkStore::EditScope _(*links_);
     history_.ReDo();
   }
 
+  ImGui::Separator();
+  if (ImGui::MenuItem("Profiler overlay", nullptr, !!profiler_)) {
+    if (profiler_) {
+      profiler_ = std::nullopt;
+      profile_.clear();
+    } else {
+      profiler_.emplace();
+    }
+  }
+  if (ImGui::MenuItem("Clear profiler records", nullptr, false, !!profiler_)) {
+    NodeProfiler::Clear();
+  }
+
   ImGui::Separator();
   if (ImGui::MenuItem("Clear history")) {
     history_.Clear();
@@ -739,6 +875,46 @@ void Network::UpdateCanvasMenu(const ImVec2& winpos) noexcept {
     Queue::main().Push([this]() { ctx_ = nullptr; });
   }
 }
+void Network::UpdateNodeProfile(const Node& n) noexcept {
+  auto itr = profile_.find(&n);
+  if (itr == profile_.end()) return;
+
+  const auto& report = itr->second;
+  const auto& st     = report.total;
+
+  // colors the frame from green to red by the share of total run time
+  const auto r = profile_max_.count()?
+      static_cast<float>(st.total.count()) / static_cast<float>(profile_max_.count()): 0.f;
+  const auto col = ImColor::HSV((1.f-r)*.33f, .8f, .9f, .3f+.7f*r);
+
+  auto dlist = ImGui::GetWindowDrawList();
+  dlist->AddRect(ImGui::GetItemRectMin(), ImGui::GetItemRectMax(), col, 0.f, 0, 4.f);
+
+  if (!ImGui::IsItemHovered()) return;
+
+  auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+  gui::NodeCanvasResetZoom();
+  ImGui::BeginTooltip();
+  ImGui::Text("count     : %zu", st.count);
+  ImGui::Text("total     : %.3f ms", ms(st.total));
+  ImGui::Text("mean      : %.3f ms", ms(st.mean()));
+  ImGui::Text("p99       : %.3f ms", ms(st.p99()));
+  ImGui::Text("queue wait: %.3f ms (mean)", ms(st.meanWait()));
+
+  ImGui::Separator();
+  ImGui::Text("%zu context(s)", report.contexts.size());
+  auto ctxs = report.contexts;
+  std::sort(ctxs.begin(), ctxs.end(),
+            [](auto& a, auto& b) { return a.total > b.total; });
+  constexpr size_t kMaxShown = 8;
+  for (size_t i = 0; i < std::min(ctxs.size(), kMaxShown); ++i) {
+    const auto& c = ctxs[i];
+    ImGui::BulletText("affinity %zu, depth %zu: %zu times, p99 %.3f ms",
+                      c.affinity, c.depth, c.count, ms(c.p99()));
+  }
+  ImGui::EndTooltip();
+  gui::NodeCanvasSetZoom();
+}
 template <typename T>
 void Network::UpdateNewIO(const ImVec2& pos) noexcept {
   constexpr auto kFlags =
@@ -777,6 +953,7 @@ void Network::NodeHolder::UpdateNode(Network& owner) noexcept {
     node_->UpdateNode(owner.ctx_);
   }
   ImNodes::EndNode();
+  if (owner.profiler_) owner.UpdateNodeProfile(*node_);
 
   constexpr auto kFlags =
       ImGuiPopupFlags_MouseButtonRight |
@@ -856,17 +1033,28 @@ void Network::History::AddNode(std::unique_ptr<NodeHolder>&& h) noexcept {
   Queue(std::make_unique<NodeSwapCommand>(owner_, std::move(h)));
 }
 void Network::History::RemoveNode(NodeHolder* h) noexcept {
+  auto links = owner_->links_.get();
+
+  // links are removed in one task to publish the index once
+  std::vector<HistoryCommand*> unlinks;
+  auto unlink = [&](const auto& in, const auto& out) {
+    auto cmd = std::make_unique<NodeLinkStore::SwapCommand>(
+        links, NodeLinkStore::SwapCommand::kUnlink, in, out);
+    unlinks.push_back(cmd.get());
+    AddSilently(std::move(cmd));
+  };
   for (const auto& in : h->node().in()) {
-    for (const auto& out : owner_->links_->GetSrcOf(in)) {
-      Queue(std::make_unique<NodeLinkStore::SwapCommand>(
-              owner_->links_.get(), NodeLinkStore::SwapCommand::kUnlink, *in, *out));
-    }
+    for (const auto& out : links->GetSrcOf(in)) unlink(*in, *out);
   }
   for (const auto& out : h->node().out()) {
-    for (const auto& in : owner_->links_->GetDstOf(out)) {
-      Queue(std::make_unique<NodeLinkStore::SwapCommand>(
-              owner_->links_.get(), NodeLinkStore::SwapCommand::kUnlink, *in, *out));
-    }
+    for (const auto& in : links->GetDstOf(out)) unlink(*in, *out);
+  }
+  if (unlinks.size()) {
+    auto task = [links, unlinks = std::move(unlinks)]() {
+      NodeLinkStore::EditScope _(*links);
+      for (auto cmd : unlinks) cmd->Apply();
+    };
+    Queue::main().Push(std::move(task));
   }
   Queue(std::make_unique<NodeSwapCommand>(owner_, std::move(h)));
 }
@@ -888,9 +1076,22 @@ class Call final : public LambdaNodeDriver {
     { "recv", "" },
   };
 
+  static constexpr Node::Flags kFlags = Node::kExternal;
+
   Call() = delete;
   Call(Owner* o, const std::weak_ptr<Context>& ctx) noexcept :
-      owner_(o), octx_(ctx) {
+      owner_(o), octx_(ctx), base_(ctx.lock()->basepath()) {
+  }
+
+  // keeps the pool to recycle the inner contexts too
+  bool Reset(const std::shared_ptr<Context>& ctx) noexcept override {
+    if (auto ictx = ictx_.lock()) ictx->Attach(nullptr);
+    ictx_.reset();
+
+    octx_ = ctx;
+    base_ = File::ResolvedPath(ctx->basepath());
+    path_ = File::ResolvedPath();
+    return true;
   }
 
   std::string title() const noexcept {
@@ -900,7 +1101,7 @@ class Call final : public LambdaNodeDriver {
   void Handle(size_t idx, Value&& v) {
     switch (idx) {
     case 0:
-      path_ = File::Path::Parse(v.string());
+      path_ = File::ResolvedPath(v.string());
       return;
     case 1:
       Send(std::move(v));
@@ -915,7 +1116,7 @@ class Call final : public LambdaNodeDriver {
       throw Exception("call depth limit reached");
     }
 
-    auto f = &owner_->root().Resolve(octx->basepath()).Resolve(path_);
+    auto f = &path_.Resolve(base_.Resolve(owner_->root()));
     if (f == owner_) throw Exception("self reference");
 
     auto n = File::iface<iface::Node>(f);
@@ -934,16 +1135,18 @@ class Call final : public LambdaNodeDriver {
       ictx = nullptr;
     }
     if (!ictx) {
-      ictx = std::make_shared<NodeRedirectContext>(
-          File::Path(octx->basepath()), octx, owner_->sharedOut(0), n);
-      n->Initialize(ictx);
+      auto factory = [&]() {
+        return new NodeRedirectContext(
+            File::Path(octx->basepath()), octx, owner_->sharedOut(0), n);
+      };
+      ictx = pool_.Create(n, octx, factory);
     }
     ictx_ = ictx;
 
     auto task = [sock, ictx, v = value]() mutable {
       sock->Receive(ictx, std::move(v));
     };
-    Queue::sub().Push(std::move(task));
+    Queue::sub(ictx->affinity()).Push(std::move(task));
   }
 
  private:
@@ -953,9 +1156,12 @@ class Call final : public LambdaNodeDriver {
 
   std::weak_ptr<Context> octx_;
 
-  Path path_;
+  File::ResolvedPath base_;
+  File::ResolvedPath path_;
 
   std::weak_ptr<NodeRedirectContext> ictx_;
+
+  NodeContextPool<NodeRedirectContext> pool_;
 };
 
 
@@ -968,8 +1174,8 @@ class SugarCall final : public File, public iface::Node {
   SugarCall(Env*               env,
             std::string_view   path  = "",
             NodeSockNameList&& names = {}) noexcept :
-      File(&kType, env), Node(Node::kMenu),
-      memento_(this, {path, std::move(names)}) {
+      File(&kType, env), Node(Node::kMenu | Node::kExternal),
+      memento_(this, {path, std::move(names)}), target_(path) {
     Rebuild();
   }
 
@@ -1016,6 +1222,7 @@ class SugarCall final : public File, public iface::Node {
         path(p), names(std::move(n)) {
     }
     void Restore(SugarCall* owner) noexcept {
+      owner->target_ = File::ResolvedPath(path);
       owner->Rebuild();
     }
 
@@ -1028,14 +1235,19 @@ class SugarCall final : public File, public iface::Node {
   // volatile
   Life life_;
 
+  File::ResolvedPath target_;
+
   std::string path_editing_;
 
   std::vector<std::unique_ptr<InSock>>  socks_in_;
   std::vector<std::unique_ptr<OutSock>> socks_out_;
 
+  class InnerContext;
+  NodeContextPool<InnerContext> pool_;
+
 
   Node& GetTargetNode() {
-    auto node = File::iface<iface::Node>(&Resolve(memento_.data().path));
+    auto node = File::iface<iface::Node>(&target_.Resolve(*this));
     if (!node) throw Exception("target is not a Node");
     return *node;
   }
@@ -1046,16 +1258,16 @@ class SugarCall final : public File, public iface::Node {
     socks_in_.reserve(udata.names.in().size());
     in_.clear();
     in_.reserve(udata.names.in().size());
-    for (const auto& name : udata.names.in()) {
-      socks_in_.push_back(std::make_unique<CustomInSock>(this, name));
+    for (auto name : udata.names.in()) {
+      socks_in_.push_back(std::make_unique<CustomInSock>(this, name.str()));
       in_.push_back(socks_in_.back().get());
     }
     socks_out_.clear();
     socks_out_.reserve(udata.names.out().size());
     out_.clear();
     out_.reserve(udata.names.out().size());
-    for (const auto& name : udata.names.out()) {
-      socks_out_.push_back(std::make_unique<OutSock>(this, name));
+    for (auto name : udata.names.out()) {
+      socks_out_.push_back(std::make_unique<OutSock>(this, name.str()));
       out_.push_back(socks_out_.back().get());
     }
     NotifySockChange();
@@ -1089,9 +1301,9 @@ class SugarCall final : public File, public iface::Node {
     try {
       if (!*life_ || sock.owner() != target_) return;
 
-      auto out = owner_->out(sock.name());
+      auto out = owner_->out(sock.symbol());
       if (!out) throw Exception("missing OutSock");
-      out->Send(octx(), Value(v));
+      out->SendDirect(octx(), Value(v));
     } catch (Exception& e) {
       NodeLoggerTextItem::Error(owner_->abspath(), *octx(), e.msg());
     }
@@ -1107,6 +1319,11 @@ class SugarCall final : public File, public iface::Node {
 
   class ContextData final : public Context::Data {
    public:
+    bool Reset(const std::shared_ptr<Context>&) noexcept override {
+      ictx = nullptr;
+      return true;
+    }
+
     std::shared_ptr<InnerContext> ictx;
   };
 
@@ -1118,13 +1335,13 @@ class SugarCall final : public File, public iface::Node {
     void Receive(const std::shared_ptr<Context>& octx, Value&& v) noexcept
     try {
       auto node = &owner_->GetTargetNode();
-      auto sock = node->in(name());
+      auto sock = node->in(symbol());
       if (!sock) throw Exception("missing InSock: "+name());
 
       auto cdata = octx->data<ContextData>(owner_);
       if (!cdata->ictx || cdata->ictx->target() != node) {
-        cdata->ictx = std::make_shared<InnerContext>(owner_, octx, node);
-        node->Initialize(cdata->ictx);
+        auto factory = [&]() { return new InnerContext(owner_, octx, node); };
+        cdata->ictx = owner_->pool_.Create(node, octx, factory);
       }
       sock->Receive(cdata->ictx, std::move(v));
     } catch (Exception& e) {
@@ -1150,8 +1367,8 @@ void SugarCall::UpdateNode(const std::shared_ptr<Editor>& ctx) noexcept {
     if (udata.names.in().empty()) {
       ImGui::TextDisabled("NO IN");
     } else {
-      for (const auto& name : udata.names.in()) {
-        gui::NodeInSock(name);
+      for (auto name : udata.names.in()) {
+        gui::NodeInSock(name.str());
       }
     }
     ImGui::EndGroup();
@@ -1162,10 +1379,10 @@ void SugarCall::UpdateNode(const std::shared_ptr<Editor>& ctx) noexcept {
     } else {
       const auto left  = ImGui::GetCursorPosX();
       const auto width = gui::CalcTextMaxWidth(
-          udata.names.out(), [](auto& x) { return x.c_str(); });
-      for (const auto& name : udata.names.out()) {
-        ImGui::SetCursorPosX(left+width - ImGui::CalcTextSize(name.c_str()).x);
-        gui::NodeOutSock(name);
+          udata.names.out(), [](auto& x) { return x.str().c_str(); });
+      for (auto name : udata.names.out()) {
+        ImGui::SetCursorPosX(left+width - ImGui::CalcTextSize(name.str().c_str()).x);
+        gui::NodeOutSock(name.str());
       }
     }
     ImGui::EndGroup();
@@ -1189,6 +1406,7 @@ void SugarCall::UpdateMenu(const std::shared_ptr<Editor>& ctx) noexcept {
       if (udata.path != path_editing_) {
         cdata->ictx = nullptr;
         udata.path = std::move(path_editing_);
+        target_    = File::ResolvedPath(udata.path);
         Sync(*ctx);
         memento_.Commit();
       }
@@ -1212,31 +1430,44 @@ class Cache final : public File, public iface::DirItem, public iface::Node {
       "Node/Cache", "stores execution result of Node",
       {typeid(iface::DirItem)});
 
-  Cache(Env* env, std::string_view path = "") noexcept :
+  static constexpr size_t kDefaultBudget = size_t {256}*1024*1024;
+
+  Cache(Env* env, std::string_view path = "", size_t budget = kDefaultBudget) noexcept :
       File(&kType, env),
       DirItem(DirItem::kMenu | DirItem::kTooltip),
-      Node(Node::kNone),
-      store_(new Store),
+      Node(Node::kExternal),
+      store_(std::make_shared<Store>(budget)),
       out_result_(this, "results"),
       in_params_(this, "params",
                  [this](auto& ctx, auto&& v) { SetParam(ctx, std::move(v)); }),
-      in_exec_(this, "exec", [this](auto& ctx, auto&&) { Exec(ctx); }),
+      in_exec_(this, "exec", [this](auto& ctx, auto&&) { StartExec(ctx); }),
       path_(path),
+      target_(path),
       logq_(std::make_shared<LoggerTemporaryItemQueue>()) {
     in_  = {&in_params_, &in_exec_};
     out_ = {&out_result_};
   }
 
+  // the old format is a path string only
   Cache(Env* env, const msgpack::object& obj)
-  try : Cache(env, obj.as<std::string_view>()) {
+  try : Cache(env,
+              (obj.type == msgpack::type::STR?
+               obj: msgpack::find(obj, "path"s)).as<std::string_view>(),
+              msgpack::as_if<size_t>(msgpack::find(obj, "budget"s), kDefaultBudget)) {
   } catch (msgpack::type_error&) {
     throw DeserializeException("broken Node/Cache");
   }
   void Serialize(Packer& pk) const noexcept override {
+    pk.pack_map(2);
+
+    pk.pack("path"s);
     pk.pack(path_);
+
+    pk.pack("budget"s);
+    pk.pack(store_->budget());
   }
   std::unique_ptr<File> Clone(Env* env) const noexcept override {
-    return std::make_unique<Cache>(env, path_);
+    return std::make_unique<Cache>(env, path_, store_->budget());
   }
 
   void Update(Event&) noexcept override {
@@ -1254,7 +1485,8 @@ class Cache final : public File, public iface::DirItem, public iface::Node {
   }
 
  private:
-  class Store;
+  using Store     = NodeCacheStore;
+  using StoreItem = NodeCacheItem;
   std::shared_ptr<Store> store_;
 
   OutSock          out_result_;
@@ -1265,8 +1497,14 @@ class Cache final : public File, public iface::DirItem, public iface::Node {
   std::string path_;
 
   // volatile
+  Life life_;
+
+  File::ResolvedPath target_;
+
   std::shared_ptr<LoggerTemporaryItemQueue> logq_;
 
+  using Param = NodeCacheItem::Param;
+
   size_t try_cnt_ = 0;
   size_t hit_cnt_ = 0;
 
@@ -1277,6 +1515,7 @@ class Cache final : public File, public iface::DirItem, public iface::Node {
   void ClearStat() noexcept {
     try_cnt_ = 0, hit_cnt_ = 0;
     last_error_ = false;
+    store_->ClearStat();
   }
 
   void SetParam(const std::shared_ptr<Context>& ctx, Value&& v)
@@ -1288,36 +1527,59 @@ class Cache final : public File, public iface::DirItem, public iface::Node {
     NodeLoggerTextItem::Error(
         abspath(), *ctx, "while setting parameter: "+e.msg());
   }
-  void Exec(const std::shared_ptr<Context>& ctx) noexcept {
-    ++try_cnt_;
+  void StartExec(const std::shared_ptr<Context>& ctx) noexcept {
+    auto catcher = [this, life = Life::Ref(life_), wctx = std::weak_ptr(ctx)](auto e) {
+      try {
+        std::rethrow_exception(e);
+      } catch (Exception& e) {
+        auto ctx = wctx.lock();
+        if (*life && ctx) NodeLoggerTextItem::Error(abspath(), *ctx, e.msg());
+      }
+    };
+    Exec(ctx).Start(std::move(catcher));
+  }
+  // Exec() modifies the store shared by all contexts,
+  // so it cannot run in parallel with other contexts.
+  Coroutine Exec(std::shared_ptr<Context> ctx) {
+    auto params = std::move(ctx->data<ContextData>(this)->params);
 
-    auto cdata = ctx->data<ContextData>(this);
+    // the sub queue is joined only when the context runs on a shard,
+    // and this may be deleted while waiting
+    Life::Ref life = life_;
+    if (&Queue::sub(ctx->affinity()) != &Queue::sub()) {
+      co_await ResumeOn(Queue::sub());
+      if (!*life) co_return;
+    }
+
+    ++try_cnt_;
 
     // a lambda that passes target node's output to self output
-    auto obs = [this, ctx](auto name, auto& value) {
+    auto obs = [this, life, ctx](auto name, auto& value) {
+      if (!*life) return;
       out_result_.Send(ctx, Value::Tuple { Value::String(name), Value(value) });
     };
 
     // observe the cache item when it's found
-    if (auto item = store_->Find(cdata->params)) {
+    const auto hash = Store::HashOf(params);
+    if (auto item = store_->Find(hash, params)) {
       ++hit_cnt_;
       item->Observe(std::move(obs));
-      return;
+      co_return;
     }
 
     // if the cache item is missing, create new one
-    auto item = store_->Allocate(std::move(cdata->params));
+    auto item = store_->Allocate(hash, std::move(params));
     item->Observe(std::move(obs));
 
     // execute the target Node and store the result to the created item
     try {
-      auto f = &Resolve(path_);
+      auto f = &target_.Resolve(*this);
       if (f == this) throw Exception("self reference");
 
       auto n = File::iface<iface::Node>(f);
       if (!n) throw Exception("it's not a Node");
 
-      auto ictx = std::make_shared<InnerContext>(logq_, f->abspath(), n, item);
+      auto ictx = std::make_shared<InnerContext>(logq_, f->abspath(), n, store_, item);
       n->Initialize(ictx);
       for (const auto& p : item->in()) {
         const auto in = n->in();
@@ -1336,74 +1598,6 @@ class Cache final : public File, public iface::DirItem, public iface::Node {
   }
 
 
-  using Param = std::pair<std::string, Value>;
-
-  class StoreItem final {
-   public:
-    friend class Store;
-
-    using Observer = std::function<void(std::string_view, const Value&)>;
-
-    void Observe(Observer&& obs) noexcept {
-      for (const auto& out : out_) {
-        obs(out.first, out.second);
-      }
-      if (!finished_) obs_.push_back(obs);
-    }
-    void Set(std::string_view name, Value&& v) noexcept {
-      assert(!finished_);
-
-      out_.emplace_back(name, v);
-      for (const auto& obs : obs_) {
-        obs(name, v);
-      }
-    }
-
-    // after calling this, Set() cannot be called
-    void Finish() noexcept {
-      obs_.clear();
-      finished_ = true;
-    }
-
-    const std::vector<Param>& in() const noexcept { return in_; }
-    const std::vector<Param>& out() const noexcept { return out_; }
-
-   private:
-    StoreItem() = delete;
-    StoreItem(std::vector<Param>&& in) noexcept : in_(std::move(in)) {
-    }
-
-    std::vector<Param> in_, out_;
-
-    std::vector<Observer> obs_;
-
-    bool finished_ = false;
-  };
-
-  class Store final {
-   public:
-    Store() noexcept { }
-
-    std::shared_ptr<StoreItem> Find(const std::vector<Param>& in) const noexcept {
-      for (const auto& item : items_) {
-        if (in == item->in()) return item;
-      }
-      return nullptr;
-    }
-    const std::shared_ptr<StoreItem>& Allocate(std::vector<Param>&& in) noexcept {
-      items_.emplace_back(new StoreItem(std::move(in)));
-      return items_.back();
-    }
-    void DropAll() noexcept {
-      items_.clear();
-    }
-
-    size_t size() const noexcept { return items_.size(); }
-
-   private:
-    std::deque<std::shared_ptr<StoreItem>> items_;
-  };
-
   // Node::Context that observes output of cache target.
   class InnerContext final : public iface::Node::Context {
    public:
@@ -1412,22 +1606,32 @@ class Cache final : public File, public iface::DirItem, public iface::Node {
     InnerContext(const std::shared_ptr<LoggerTemporaryItemQueue>& logq,
                  Path&&                          basepath,
                  Node*                           target,
-                 const std::weak_ptr<StoreItem>& item) noexcept :
-        Context(std::move(basepath)), logq_(logq), target_(target), item_(item) {
+                 const std::weak_ptr<Store>&       store,
+                 const std::shared_ptr<StoreItem>& item) noexcept :
+        Context(std::move(basepath)),
+        logq_(logq), target_(target), store_(store), item_(item) {
     }
     ~InnerContext() {
-      auto item = item_.lock();
-      if (item) item->Finish();
+      // pushed after outputs to be set, so that the item is finished after them
+      auto task = [store = store_, item = std::move(item_)]() {
+        if (auto s = store.lock()) {
+          s->Finish(*item);
+        } else {
+          item->Finish();
+        }
+      };
+      Queue::sub().Push(std::move(task));
     }
 
     void ObserveSend(const Node::OutSock& sock, const Value& v) noexcept override {
       if (sock.owner() != target_) return;
 
-      auto item = item_.lock();
-      if (!item) return;
-
-      auto task = [item, name = sock.name(), v = v]() mutable {
-        item->Set(std::move(name), std::move(v));
+      auto task = [store = store_, item = item_, name = sock.name(), v = v]() mutable {
+        if (auto s = store.lock()) {
+          s->Set(*item, name, std::move(v));
+        } else {
+          item->Set(name, std::move(v));
+        }
       };
       Queue::sub().Push(std::move(task));
     }
@@ -1440,11 +1644,19 @@ class Cache final : public File, public iface::DirItem, public iface::Node {
 
     Node* target_;
 
-    std::weak_ptr<StoreItem> item_;
+    std::weak_ptr<Store> store_;
+
+    // the item is kept alive until the execution ends even if it's evicted
+    std::shared_ptr<StoreItem> item_;
   };
 
   class ContextData final : public Context::Data {
    public:
+    bool Reset(const std::shared_ptr<Context>&) noexcept override {
+      params.clear();
+      return true;
+    }
+
     std::vector<Param> params;
   };
 };
@@ -1456,10 +1668,25 @@ void Cache::UpdateMenu() noexcept {
     ClearStat();
   }
   ImGui::Separator();
+  if (ImGui::BeginMenu("memory budget")) {
+    constexpr uint64_t kMiB = 1024*1024;
+
+    auto mib = static_cast<uint64_t>(store_->budget()/kMiB);
+    ImGui::SetNextItemWidth(8*ImGui::GetFontSize());
+    if (ImGui::DragScalar("MiB", ImGuiDataType_U64, &mib)) {
+      store_->SetBudget(static_cast<size_t>(std::max(mib, uint64_t {1})*kMiB));
+    }
+    if (ImGui::IsItemHovered()) {
+      ImGui::SetTooltip("least recently used items are evicted when "
+                        "strings and tensors in the store exceed this");
+    }
+    ImGui::EndMenu();
+  }
   if (ImGui::BeginMenu("target path")) {
     if (gui::InputPathMenu("##path_edit", this, &path_editing_)) {
       if (path_ != path_editing_) {
-        path_ = std::move(path_editing_);
+        path_   = std::move(path_editing_);
+        target_ = File::ResolvedPath(path_);
         store_->DropAll();
         ClearStat();
       }
@@ -1471,7 +1698,9 @@ void Cache::UpdateTooltip() noexcept {
   ImGui::Indent();
   ImGui::Text("target      : %s", path_.c_str());
   ImGui::Text("store size  : %zu", store_->size());
+  ImGui::Text("store bytes : %zu / %zu", store_->bytes(), store_->budget());
   ImGui::Text("try/hit/miss: %zu/%zu/%zu", try_cnt_, hit_cnt_, try_cnt_-hit_cnt_);
+  ImGui::Text("evicted     : %zu", store_->evictCount());
   if (try_cnt_ > 0) {
     ImGui::Text("hit rate    : %f%%",
                 static_cast<float>(hit_cnt_)/static_cast<float>(try_cnt_)*100.f);
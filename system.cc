@@ -1,15 +1,24 @@
 #include "kingtaker.hh"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <chrono>
 #include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 #include <imgui.h>
 #include <imgui_internal.h>
 #include <imgui_stdlib.h>
 #include <ImNodes.h>
+#include <implot.h>
 
 #include "kingtaker.hh"
 
@@ -19,9 +28,12 @@
 
 #include "util/gui.hh"
 #include "util/keymap.hh"
+#include "util/life.hh"
 #include "util/logger.hh"
 #include "util/node.hh"
 #include "util/ptr_selector.hh"
+#include "util/queue.hh"
+#include "util/tracer.hh"
 #include "util/value.hh"
 
 
@@ -292,16 +304,22 @@ class ImGuiConfig : public File {
 class ClockPulseGenerator final : public File, public iface::DirItem {
  public:
   static inline TypeInfo kType = TypeInfo::New<ClockPulseGenerator>(
-      "System/ClockPulseGenerator", "emits a pulse into a specific node on each GUI updates",
+      "System/ClockPulseGenerator",
+      "emits a pulse into a specific node on each GUI updates or at a fixed rate",
       {typeid(iface::DirItem)});
 
+  static constexpr float kMaxRate = 1000.f;
+
   ClockPulseGenerator(Env*               env,
                       const std::string& path      = "",
                       const std::string& sock_name = "",
                       bool               shown     = false,
-                      bool               enable    = false) noexcept :
+                      bool               enable    = false,
+                      float              rate      = 0.f) noexcept :
       File(&kType, env), DirItem(kNone),
       path_(path), sock_name_(sock_name), shown_(shown), enable_(enable),
+      rate_(std::clamp(rate, 0.f, kMaxRate)),
+      target_(path),
       logq_(std::make_shared<LoggerTemporaryItemQueue>()) {
   }
 
@@ -310,10 +328,11 @@ class ClockPulseGenerator final : public File, public iface::DirItem {
                           msgpack::find(obj, "path"s).as<std::string>(),
                           msgpack::find(obj, "sock_name"s).as<std::string>(),
                           msgpack::as_if<bool>(msgpack::find(obj, "shown"s), false),
-                          msgpack::as_if<bool>(msgpack::find(obj, "enable"s), false)) {
+                          msgpack::as_if<bool>(msgpack::find(obj, "enable"s), false),
+                          msgpack::as_if<float>(msgpack::find(obj, "rate"s), 0.f)) {
   }
   void Serialize(Packer& pk) const noexcept override {
-    pk.pack_map(4);
+    pk.pack_map(5);
 
     pk.pack("path"s);
     pk.pack(path_);
@@ -326,13 +345,24 @@ class ClockPulseGenerator final : public File, public iface::DirItem {
 
     pk.pack("enable"s);
     pk.pack(enable_);
+
+    pk.pack("rate"s);
+    pk.pack(rate_);
   }
   std::unique_ptr<File> Clone(Env* env) const noexcept override {
-    return std::make_unique<ClockPulseGenerator>(env, path_, sock_name_, shown_, enable_);
+    return std::make_unique<ClockPulseGenerator>(
+        env, path_, sock_name_, shown_, enable_, rate_);
   }
 
   void Update(Event& ev) noexcept override {
-    if (enable_) Emit();
+    if (enable_) {
+      if (rate_ <= 0) {
+        Emit();
+      } else if (!ticking_) {
+        ticking_ = true;
+        Tick(++chain_, std::chrono::steady_clock::now());
+      }
+    }
 
     if (gui::BeginWindow(this, "ClockPulseGenerator", ev, &shown_)) {
       UpdateEditor();
@@ -354,7 +384,18 @@ class ClockPulseGenerator final : public File, public iface::DirItem {
   bool shown_;
   bool enable_;
 
+  // pulses per second, or zero to emit on each GUI update
+  float rate_;
+
   // volatile params
+  Life life_;
+
+  File::ResolvedPath target_;
+
+  // a chain of timer tasks is running, and ones from older chains are ignored
+  bool     ticking_ = false;
+  uint64_t chain_   = 0;
+
   std::shared_ptr<LoggerTemporaryItemQueue> logq_;
 
   std::string path_editing_;
@@ -362,7 +403,7 @@ class ClockPulseGenerator final : public File, public iface::DirItem {
 
   void Emit() noexcept {
     try {
-      auto& target = Resolve(path_);
+      auto& target = target_.Resolve(*this);
 
       auto n = File::iface<iface::Node>(&target);
       if (!n) throw Exception("target doesn't have Node interface");
@@ -379,6 +420,24 @@ class ClockPulseGenerator final : public File, public iface::DirItem {
     }
   }
 
+  // Emits from the sub queue at time t and schedules the next pulse. Pulses
+  // missed by a busy queue are skipped instead of being emitted in a burst.
+  void Tick(uint64_t chain, std::chrono::steady_clock::time_point t) noexcept {
+    auto task = [this, life = Life::Ref(life_), chain, t]() {
+      if (!*life || chain != chain_) return;
+      if (!enable_ || rate_ <= 0) {
+        ticking_ = false;
+        return;
+      }
+      Emit();
+
+      const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(1./rate_));
+      Tick(chain, std::max(t+period, std::chrono::steady_clock::now()));
+    };
+    Queue::sub().PushAt(t, std::move(task));
+  }
+
 
   class InnerContext final : public iface::Node::Context {
    public:
@@ -407,7 +466,8 @@ void ClockPulseGenerator::UpdateEditor() noexcept {
       }
       if (ImGui::BeginPopupContextItem(nullptr, ImGuiPopupFlags_MouseButtonLeft)) {
         if (gui::InputPathMenu("##path_input", this, &path_editing_)) {
-          path_ = std::move(path_editing_);
+          path_   = std::move(path_editing_);
+          target_ = File::ResolvedPath(path_);
         }
         ImGui::EndPopup();
       }
@@ -427,7 +487,17 @@ void ClockPulseGenerator::UpdateEditor() noexcept {
       ImGui::InputText("socket name", &sock_name_);
     }
     if (enable_) ImGui::EndDisabled();
-    ImGui::Checkbox("enable", &enable_);
+
+    if (ImGui::DragFloat("rate", &rate_, 1.f, 0.f, kMaxRate, "%.3f Hz",
+                         ImGuiSliderFlags_Logarithmic | ImGuiSliderFlags_AlwaysClamp)) {
+      ticking_ = false;
+    }
+    if (ImGui::IsItemHovered()) {
+      ImGui::SetTooltip("pulses per second (0 emits on each GUI update)");
+    }
+    if (ImGui::Checkbox("enable", &enable_)) {
+      ticking_ = false;
+    }
   }
   ImGui::PopItemWidth();
 }
@@ -550,4 +620,355 @@ void Logger::UpdateMenu() noexcept {
   ImGui::MenuItem("shown", nullptr, &shown_);
 }
 
+
+class QueueMonitor final : public File, public iface::DirItem {
+ public:
+  static inline TypeInfo kType = TypeInfo::New<QueueMonitor>(
+      "System/QueueMonitor", "plots telemetry of task queues",
+      {typeid(iface::DirItem)});
+
+  static constexpr auto   kInterval = std::chrono::milliseconds(500);
+  static constexpr size_t kHistory  = 240;
+
+  QueueMonitor(Env* env, bool shown = true) noexcept :
+      File(&kType, env), DirItem(DirItem::kMenu), shown_(shown) {
+  }
+
+  QueueMonitor(Env* env, const msgpack::object& obj) noexcept :
+      QueueMonitor(env, msgpack::as_if<bool>(obj, false)) {
+  }
+  void Serialize(Packer& pk) const noexcept override {
+    pk.pack(shown_);
+  }
+  std::unique_ptr<File> Clone(Env* env) const noexcept override {
+    return std::make_unique<QueueMonitor>(env, shown_);
+  }
+
+  void Update(Event&) noexcept override;
+  void UpdateMenu() noexcept override;
+
+  void* iface(const std::type_index& t) noexcept override {
+    return PtrSelector<iface::DirItem>(t).Select(this);
+  }
+
+ private:
+  using Clock  = QueueStats::SteadyClock;
+  using Counts = QueueHistogram::Counts;
+
+  bool shown_;
+
+  // queues measure durations only while this is alive
+  std::optional<QueueStats::Session> session_;
+
+  struct Series final {
+    std::string name;
+
+    size_t prev_started = 0;
+    Counts prev_wait    = {};
+    Counts prev_run     = {};
+
+    // all durations are in micro seconds
+    std::vector<float> depth, tps, wait50, wait99, run50, run99;
+
+    void Sample(const QueueStats&, float dt) noexcept;
+    std::array<std::vector<float>*, 6> all() noexcept {
+      return {&depth, &tps, &wait50, &wait99, &run50, &run99};
+    }
+  };
+  std::vector<float>  time_;
+  std::vector<Series> series_;
+
+  Clock::time_point epoch_ = Clock::now();
+  Clock::time_point last_;
+
+
+  void Sample() noexcept;
+};
+void QueueMonitor::Update(Event& ev) noexcept {
+  if (!shown_) {
+    session_ = std::nullopt;
+    return;
+  }
+  if (!session_) session_.emplace();
+
+  const auto now = Clock::now();
+  if (now-last_ >= kInterval) {
+    Sample();
+    last_ = now;
+  }
+  // keeps sampling while GUI is idle
+  File::RequestRedraw(last_+kInterval-now);
+
+  if (gui::BeginWindow(this, "QueueMonitor", ev, &shown_)) {
+    const auto n = static_cast<int>(time_.size());
+    const auto plot = [&](const char* title, const char* unit, auto member) {
+      if (!ImPlot::BeginPlot(title, ImVec2(-1, 0))) return;
+      ImPlot::SetupAxes("sec", unit, ImPlotAxisFlags_AutoFit, ImPlotAxisFlags_AutoFit);
+      for (const auto& s : series_) {
+        ImPlot::PlotLine(s.name.c_str(), time_.data(), (s.*member).data(), n);
+      }
+      ImPlot::EndPlot();
+    };
+    plot("depth",     "tasks",  &Series::depth);
+    plot("throughput", "tasks/s", &Series::tps);
+    plot("wait p50",  "us",     &Series::wait50);
+    plot("wait p99",  "us",     &Series::wait99);
+    plot("run p50",   "us",     &Series::run50);
+    plot("run p99",   "us",     &Series::run99);
+  }
+  gui::EndWindow();
+}
+void QueueMonitor::UpdateMenu() noexcept {
+  ImGui::MenuItem("shown", nullptr, &shown_);
+}
+void QueueMonitor::Sample() noexcept {
+  const auto now = Clock::now();
+  const auto t   = std::chrono::duration<float>(now-epoch_).count();
+  const auto dt  = time_.empty()? 0.f: t-time_.back();
+
+  // queues are alive through the whole app so the list rarely changes,
+  // but series are matched by name to be safe
+  const auto stats = QueueStats::instances();
+  for (auto st : stats) {
+    auto itr = std::find_if(series_.begin(), series_.end(),
+                            [&](auto& s) { return s.name == st->name(); });
+    if (itr == series_.end()) {
+      series_.push_back({});
+      itr = series_.end()-1;
+      itr->name = st->name();
+      itr->prev_started = st->started();
+      itr->prev_wait    = st->wait().Snapshot();
+      itr->prev_run     = st->run().Snapshot();
+
+      // fill the past with zero to align with time_
+      for (auto v : itr->all()) v->assign(time_.size(), 0.f);
+    }
+    itr->Sample(*st, dt);
+  }
+  time_.push_back(t);
+
+  if (time_.size() > kHistory) {
+    const auto drop = static_cast<intmax_t>(time_.size()-kHistory);
+    time_.erase(time_.begin(), time_.begin()+drop);
+    for (auto& s : series_) {
+      for (auto v : s.all()) {
+        if (v->size() > kHistory) {
+          v->erase(v->begin(), v->begin()+static_cast<intmax_t>(v->size()-kHistory));
+        }
+      }
+    }
+  }
+}
+void QueueMonitor::Series::Sample(const QueueStats& st, float dt) noexcept {
+  const auto started = st.started();
+  const auto wait    = st.wait().Snapshot();
+  const auto run     = st.run().Snapshot();
+
+  Counts dwait, drun;
+  for (size_t i = 0; i < QueueHistogram::kBuckets; ++i) {
+    dwait[i] = wait[i] - prev_wait[i];
+    drun[i]  = run[i]  - prev_run[i];
+  }
+  const auto us = [](uint64_t ns) { return static_cast<float>(ns)/1000.f; };
+
+  depth.push_back(static_cast<float>(st.depth()));
+  tps.push_back(dt > 0? static_cast<float>(started-prev_started)/dt: 0.f);
+  wait50.push_back(us(QueueHistogram::Percentile(dwait, .50)));
+  wait99.push_back(us(QueueHistogram::Percentile(dwait, .99)));
+  run50.push_back(us(QueueHistogram::Percentile(drun, .50)));
+  run99.push_back(us(QueueHistogram::Percentile(drun, .99)));
+
+  prev_started = started;
+  prev_wait    = wait;
+  prev_run     = run;
+}
+
+
+class TraceRecorder final : public File, public iface::DirItem {
+ public:
+  static inline TypeInfo kType = TypeInfo::New<TraceRecorder>(
+      "System/TraceRecorder", "records node messages and queue tasks, and exports them as Chrome trace JSON",
+      {typeid(iface::DirItem)});
+
+  TraceRecorder(Env*               env,
+                const std::string& path  = "trace.json",
+                bool               shown = true) noexcept :
+      File(&kType, env), DirItem(DirItem::kMenu), path_(path), shown_(shown) {
+  }
+
+  TraceRecorder(Env* env, const msgpack::object& obj) :
+      TraceRecorder(env,
+                    msgpack::find(obj, "path"s).as<std::string>(),
+                    msgpack::as_if<bool>(msgpack::find(obj, "shown"s), false)) {
+  }
+  void Serialize(Packer& pk) const noexcept override {
+    pk.pack_map(2);
+
+    pk.pack("path"s);
+    pk.pack(path_);
+
+    pk.pack("shown"s);
+    pk.pack(shown_);
+  }
+  std::unique_ptr<File> Clone(Env* env) const noexcept override {
+    return std::make_unique<TraceRecorder>(env, path_, shown_);
+  }
+
+  void Update(Event&) noexcept override;
+  void UpdateMenu() noexcept override;
+
+  void* iface(const std::type_index& t) noexcept override {
+    return PtrSelector<iface::DirItem>(t).Select(this);
+  }
+
+ private:
+  std::string path_;
+
+  bool shown_;
+
+  std::string status_;
+
+
+  void Export() noexcept;
+
+  static std::string Escape(std::string_view) noexcept;
+  static std::string PathOf(const Tracer::Event&) noexcept;
+};
+void TraceRecorder::Update(Event& ev) noexcept {
+  if (!shown_) return;
+
+  if (gui::BeginWindow(this, "TraceRecorder", ev, &shown_)) {
+    const bool rec = Tracer::enabled();
+    if (ImGui::Button(rec? "stop": "start")) {
+      if (rec) {
+        Tracer::Stop();
+        status_ = "stopped";
+      } else {
+        Tracer::Start();
+        status_ = "recording...";
+      }
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("export")) {
+      Tracer::Stop();
+      Export();
+    }
+    if (ImGui::IsItemHovered()) {
+      ImGui::SetTooltip("stops recording and writes Chrome trace JSON,\n"
+                        "which can be opened by chrome://tracing or Perfetto");
+    }
+    ImGui::InputText("output", &path_);
+    ImGui::TextUnformatted(status_.c_str());
+  }
+  gui::EndWindow();
+}
+void TraceRecorder::UpdateMenu() noexcept {
+  ImGui::MenuItem("shown", nullptr, &shown_);
+}
+void TraceRecorder::Export() noexcept {
+  const auto threads = Tracer::Snapshot();
+
+  std::optional<Tracer::Time> epoch;
+  for (const auto& th : threads) {
+    for (const auto& e : th.events) {
+      if (!epoch || e.begin < *epoch) epoch = e.begin;
+    }
+  }
+  if (!epoch) {
+    status_ = "nothing recorded";
+    return;
+  }
+
+  std::ofstream f(path_, std::ios::binary);
+  if (!f) {
+    status_ = "failed to open "+path_;
+    return;
+  }
+  f << std::fixed << std::setprecision(3);
+
+  const auto us = [](Tracer::Dur d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+  };
+  size_t n = 0;
+  const auto begin = [&](const char* ph, size_t tid, Tracer::Time t) -> std::ostream& {
+    f << (n++? ",\n": "") << "{\"ph\":\"" << ph << "\",\"pid\":0,\"tid\":" << tid
+      << ",\"ts\":" << us(t-*epoch);
+    return f;
+  };
+
+  f << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+  for (const auto& th : threads) {
+    f << (n++? ",\n": "")
+      << "{\"ph\":\"M\",\"pid\":0,\"tid\":" << th.tid
+      << ",\"name\":\"thread_name\",\"args\":{\"name\":\"" << Escape(th.name) << "\"}}";
+
+    for (const auto& e : th.events) {
+      switch (e.type) {
+      case Tracer::kSend:
+        // a flow start binds to the receive slice enclosing it
+        begin("i", th.tid, e.begin)
+            << ",\"s\":\"t\",\"cat\":\"send\",\"name\":\"" << Escape(e.sock.str())
+            << "\",\"args\":{\"path\":\"" << Escape(PathOf(e))
+            << "\",\"depth\":" << e.depth
+            << ",\"type\":\"" << Escape(e.vtype? e.vtype: "") << "\"}}";
+        begin("s", th.tid, e.begin)
+            << ",\"cat\":\"msg\",\"name\":\"msg\",\"id\":" << e.flow << "}";
+        break;
+      case Tracer::kReceive:
+        begin("X", th.tid, e.begin)
+            << ",\"dur\":" << us(e.dur)
+            << ",\"cat\":\"receive\",\"name\":\"" << Escape(e.sock.str())
+            << "\",\"args\":{\"path\":\"" << Escape(PathOf(e))
+            << "\",\"depth\":" << e.depth
+            << ",\"type\":\"" << Escape(e.vtype? e.vtype: "") << "\"}}";
+        if (e.flow) {
+          begin("f", th.tid, e.begin)
+              << ",\"bp\":\"e\",\"cat\":\"msg\",\"name\":\"msg\",\"id\":" << e.flow << "}";
+        }
+        break;
+      case Tracer::kTask:
+        begin("X", th.tid, e.begin)
+            << ",\"dur\":" << us(e.dur)
+            << ",\"cat\":\"task\",\"name\":\"" << Escape(e.queue? e.queue: "")
+            << "\",\"args\":{\"wait_us\":" << us(e.wait) << "}}";
+        break;
+      }
+    }
+  }
+  f << "\n]}\n";
+
+  status_ = f? "exported "+std::to_string(n)+" events to "+path_:
+               "failed to write "+path_;
+}
+std::string TraceRecorder::Escape(std::string_view str) noexcept {
+  std::string ret;
+  ret.reserve(str.size());
+  for (const auto c : str) {
+    switch (c) {
+    case '"':  ret += "\\\""; break;
+    case '\\': ret += "\\\\"; break;
+    case '\n': ret += "\\n"; break;
+    case '\t': ret += "\\t"; break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+        ret += buf;
+      } else {
+        ret += c;
+      }
+    }
+  }
+  return ret;
+}
+std::string TraceRecorder::PathOf(const Tracer::Event& e) noexcept {
+  if (e.path) return *e.path;
+  if (!e.node) return "";
+
+  // the node is still alive if no file has been deleted since the recording
+  if (e.generation != File::generation()) return "(unknown)";
+  auto f = dynamic_cast<const File*>(static_cast<const iface::Node*>(e.node));
+  return f? f->abspath().Stringify(): "";
+}
+
 } }  // namespace kingtaker
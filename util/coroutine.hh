@@ -0,0 +1,286 @@
+#pragma once
+
+#include "kingtaker.hh"
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+
+namespace kingtaker {
+
+// A fire-and-forget coroutine that owns itself after started.
+// Suspended state lives in a frame taken from a thread-local pool,
+// and the frame is destroyed when the coroutine reaches the end.
+//
+// Example:
+//   Coroutine Proc(std::shared_ptr<Context> ctx) {
+//     co_await ResumeOn(Queue::gl());
+//     ...  // runs on GL thread
+//     co_await ResumeOn(Queue::sub(ctx->affinity()));
+//     ...  // runs on sub thread
+//   }
+//   Proc(ctx).Start([](auto e) { ... });
+class Coroutine final {
+ public:
+  class promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  // Receives an exception thrown inside the coroutine in the thread where the
+  // coroutine was running. An exception escaping from the catcher terminates.
+  using Catcher = std::function<void(std::exception_ptr)>;
+
+  // Resumes the coroutine and destroys it if it reaches the end.
+  // An exception thrown inside is passed to the catcher after the destruction,
+  // so resuming from queue tasks never throws into the queue.
+  static inline void Resume(Handle h) noexcept;
+
+  Coroutine() = delete;
+  Coroutine(Handle h) noexcept : h_(h) {
+  }
+  ~Coroutine() noexcept {
+    if (h_) h_.destroy();  // never started
+  }
+  Coroutine(const Coroutine&) = delete;
+  Coroutine(Coroutine&& src) noexcept : h_(std::exchange(src.h_, nullptr)) {
+  }
+  Coroutine& operator=(const Coroutine&) = delete;
+  Coroutine& operator=(Coroutine&&) = delete;
+
+  // Runs the coroutine until its first suspension in this thread.
+  // Exceptions thrown before and after the suspension go to the catcher.
+  inline void Start(Catcher&& c) && noexcept;
+
+ private:
+  Handle h_;
+};
+
+
+// Frame allocator of coroutines that keeps freed frames in thread-local caches.
+// Frames can be freed in a thread different from where they are allocated.
+class CoroutineFramePool final {
+ public:
+  static constexpr size_t kUnit      = 64;
+  static constexpr size_t kClasses   = 32;  // frames larger than 2 KiB are not pooled
+  static constexpr size_t kCacheSize = 64;  // for each class
+
+  static void* Allocate(size_t n) {
+    const auto c = ClassOf(n);
+    if (c < kClasses) {
+      auto& cache = caches()[c];
+      if (cache.size()) {
+        auto ret = cache.back();
+        cache.pop_back();
+        return ret;
+      }
+      return ::operator new((c+1)*kUnit);
+    }
+    return ::operator new(n);
+  }
+  static void Free(void* ptr, size_t n) noexcept {
+    const auto c = ClassOf(n);
+    if (c < kClasses) {
+      auto& cache = caches()[c];
+      if (cache.size() < kCacheSize) {
+        cache.push_back(ptr);
+        return;
+      }
+    }
+    ::operator delete(ptr);
+  }
+
+ private:
+  static size_t ClassOf(size_t n) noexcept {
+    return n? (n-1)/kUnit: 0;
+  }
+
+  struct Caches final {
+    ~Caches() noexcept {
+      for (auto& c : items) {
+        for (auto ptr : c) ::operator delete(ptr);
+      }
+    }
+    std::array<std::vector<void*>, kClasses> items;
+  };
+  static std::array<std::vector<void*>, kClasses>& caches() noexcept {
+    static thread_local Caches caches_;
+    return caches_.items;
+  }
+};
+
+
+class Coroutine::promise_type final {
+ public:
+  static void* operator new(size_t n) {
+    return CoroutineFramePool::Allocate(n);
+  }
+  static void operator delete(void* ptr, size_t n) noexcept {
+    CoroutineFramePool::Free(ptr, n);
+  }
+
+  Coroutine get_return_object() noexcept {
+    return Coroutine(Handle::from_promise(*this));
+  }
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  std::suspend_always final_suspend() const noexcept { return {}; }
+
+  void return_void() const noexcept { }
+  void unhandled_exception() noexcept {
+    exception_ = std::current_exception();
+  }
+
+  std::exception_ptr exception() const noexcept { return exception_; }
+
+ private:
+  friend class Coroutine;
+
+  std::exception_ptr exception_;
+
+  Catcher catcher_;
+};
+void Coroutine::Resume(Handle h) noexcept {
+  h.resume();
+  if (!h.done()) return;
+
+  auto e = h.promise().exception();
+  auto c = std::move(h.promise().catcher_);
+  h.destroy();
+  if (e && c) c(e);
+}
+void Coroutine::Start(Catcher&& c) && noexcept {
+  h_.promise().catcher_ = std::move(c);
+  Resume(std::exchange(h_, nullptr));
+}
+
+
+// Awaitable that resumes the coroutine as a task of the queue.
+class ResumeOn final {
+ public:
+  ResumeOn(Queue& q) noexcept : q_(&q) {
+  }
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(Coroutine::Handle h) const noexcept {
+    q_->Push([h]() { Coroutine::Resume(h); });
+  }
+  void await_resume() const noexcept { }
+
+ private:
+  Queue* q_;
+};
+
+
+// A value that coroutines can wait for, such as the last one received by an
+// input socket. Waiters are resumed in the thread calling Set(), or with
+// nullopt when the latch dies while they are waiting, so no suspended frame
+// is left behind. A waiting frame must not own the latch, so Wait() takes
+// the latch owner as a weak pointer and holds no reference while suspended.
+//
+// Example:
+//   auto func = co_await Latch::Wait(std::weak_ptr(cdata), &Data::func);
+//   if (!func) co_return;  // the data has died
+template <typename T>
+class CoroutineLatch final {
+ public:
+  template <typename O>
+  class Awaiter;
+
+  template <typename O>
+  static Awaiter<O> Wait(std::weak_ptr<O> owner, CoroutineLatch O::* latch) noexcept {
+    return Awaiter<O>(std::move(owner), latch);
+  }
+
+  CoroutineLatch() = default;
+  ~CoroutineLatch() noexcept {
+    for (auto& w : waiters_) Coroutine::Resume(w.h);
+  }
+  CoroutineLatch(const CoroutineLatch&) = delete;
+  CoroutineLatch(CoroutineLatch&&) = delete;
+  CoroutineLatch& operator=(const CoroutineLatch&) = delete;
+  CoroutineLatch& operator=(CoroutineLatch&&) = delete;
+
+  // Stores the value and resumes all waiters with copies of it.
+  void Set(const T& v) noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    value_ = v;
+    auto waiters = std::move(waiters_);
+    waiters_.clear();
+    k.unlock();
+
+    for (auto& w : waiters) {
+      *w.dst = v;
+      Coroutine::Resume(w.h);
+    }
+  }
+  void Clear() noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    value_ = std::nullopt;
+  }
+
+  std::optional<T> value() const noexcept {
+    std::unique_lock<std::mutex> k(mtx_);
+    return value_;
+  }
+
+ private:
+  mutable std::mutex mtx_;
+
+  std::optional<T> value_;
+
+  struct Waiter final {
+    Coroutine::Handle h;
+    std::optional<T>* dst;
+  };
+  std::vector<Waiter> waiters_;
+};
+template <typename T>
+template <typename O>
+class CoroutineLatch<T>::Awaiter final {
+ public:
+  Awaiter(std::weak_ptr<O>&& owner, CoroutineLatch O::* latch) noexcept :
+      owner_(std::move(owner)), latch_(latch) {
+  }
+
+  bool await_ready() noexcept {
+    auto owner = owner_.lock();
+    if (!owner) return true;
+
+    auto& l = (*owner).*latch_;
+    std::unique_lock<std::mutex> k(l.mtx_);
+    v_ = l.value_;
+    return !!v_;
+  }
+  bool await_suspend(Coroutine::Handle h) noexcept {
+    // the owner can die and resume the frame right after this returns,
+    // so nothing in this object is touched after the registration
+    auto owner = owner_.lock();
+    if (!owner) return false;
+
+    auto& l = (*owner).*latch_;
+    std::unique_lock<std::mutex> k(l.mtx_);
+    if (l.value_) {  // set while suspending
+      v_ = l.value_;
+      return false;
+    }
+    l.waiters_.push_back({h, &v_});
+    return true;
+  }
+  std::optional<T> await_resume() noexcept { return std::move(v_); }
+
+ private:
+  std::weak_ptr<O> owner_;
+
+  CoroutineLatch O::* latch_;
+
+  std::optional<T> v_;
+};
+
+}  // namespace kingtaker
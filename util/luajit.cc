@@ -1,5 +1,8 @@
 #include "util/luajit.hh"
 
+#include "util/queue.hh"
+#include "util/tracer.hh"
+
 
 namespace kingtaker::luajit {
 
@@ -62,24 +65,36 @@ static int L_PushValue(lua_State* L) {
 
 
 void Device::Main() noexcept {
+  Tracer::NameThread(stats_.name().c_str());
+
   std::unique_lock<std::mutex> k(mtx_);
   while (alive_) {
-    cv_.wait(k);
-    for (;;) {
-      if (cmds_.empty()) break;
+    cv_.wait(k, [this]() { return !alive_ || !cmds_.empty(); });
+    while (!cmds_.empty()) {
       if (!L) {
         k.unlock();
-        if (!SetUp()) break;
+        const bool ok = SetUp();
         k.lock();
+
+        // commands are discarded but counted as done, not to be waited forever
+        if (!ok) {
+          for (; !cmds_.empty(); cmds_.pop_front()) {
+            stats_.RecordStart({});
+            stats_.RecordEnd({}, {});
+          }
+          break;
+        }
       }
 
-      auto cmd = std::move(cmds_.front());
+      auto item = std::move(cmds_.front());
       cmds_.pop_front();
 
       // clear stack and execute the command
       k.unlock();
+      const auto t0 = stats_.RecordStart(item.pushed);
       lua_settop(L, 0);
-      cmd(L);
+      item.cmd(L);
+      stats_.RecordEnd(item.pushed, t0);
       k.lock();
     }
   }
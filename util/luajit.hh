@@ -12,6 +12,8 @@
 
 #include <lua.hpp>
 
+#include "util/coroutine.hh"
+#include "util/queue.hh"
 #include "util/value.hh"
 
 
@@ -19,7 +21,9 @@ namespace kingtaker::luajit {
 
 class Device final {
  public:
-  using Command = std::function<void(lua_State* L)>;
+  using Command = SmallFunction<void(lua_State* L)>;
+
+  class Awaiter;
 
   class RuntimeException : public HeavyException {
    public:
@@ -31,21 +35,31 @@ class Device final {
     }
   };
 
-  Device() noexcept {
+  Device() noexcept : stats_("luajit") {
     th_ = std::thread([this]() { Main(); });
   }
   ~Device() noexcept {
-    alive_ = false;
+    {
+      std::unique_lock<std::mutex> k(mtx_);
+      alive_ = false;
+    }
     cv_.notify_all();
     th_.join();
   }
 
   void Queue(Command&& cmd) noexcept {
     std::unique_lock<std::mutex> k(mtx_);
-    cmds_.push_back(std::move(cmd));
+    cmds_.push_back({std::move(cmd), QueueStats::PushTime()});
+    stats_.RecordPush();
     cv_.notify_all();
   }
 
+  // commands are counted as tasks of a queue named "luajit"
+  const QueueStats& stats() const noexcept { return stats_; }
+
+  // returns an awaitable that resumes the coroutine in lua thread
+  inline Awaiter Enter() noexcept;
+
 
   static void PushValue(lua_State* L, const Value& v) noexcept;
 
@@ -106,13 +120,20 @@ class Device final {
   lua_State* L = nullptr;
 
   // thread and command queue
+  struct Item final {
+    Command cmd;
+
+    QueueStats::SteadyClock::time_point pushed;
+  };
   std::thread             th_;
-  std::deque<Command>     cmds_;
+  std::deque<Item>        cmds_;
   std::mutex              mtx_;
   std::condition_variable cv_;
 
   std::atomic<bool> alive_ = true;
 
+  QueueStats stats_;
+
 
   // lua values (modified only from lua thread)
   int imm_table_ = LUA_REFNIL;
@@ -123,6 +144,27 @@ class Device final {
 };
 
 
+class Device::Awaiter final {
+ public:
+  Awaiter(Device* dev) noexcept : dev_(dev) {
+  }
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(Coroutine::Handle h) noexcept {
+    dev_->Queue([this, h](auto L) { L_ = L; Coroutine::Resume(h); });
+  }
+  lua_State* await_resume() const noexcept { return L_; }
+
+ private:
+  Device* dev_;
+
+  lua_State* L_ = nullptr;
+};
+Device::Awaiter Device::Enter() noexcept {
+  return Awaiter(this);
+}
+
+
 class Obj final : public Value::Data {
  public:
   static inline const char* kName = "kingtaker::luajit::Obj";
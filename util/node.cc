@@ -1,5 +1,7 @@
 #include "util/node.hh"
 
+#include <algorithm>
+#include <numeric>
 #include <type_traits>
 #include <unordered_set>
 
@@ -10,42 +12,55 @@ namespace kingtaker {
 
 class NodeLinkStore::Observer final : public Node::Observer {
  public:
-  static void Register(NodeLinkStore* owner, Node* node) noexcept {
-    auto& obs = owner->obs_;
-    auto& ptr = obs[node];
+  static Observer& Register(NodeLinkStore* owner, Node* node) noexcept {
+    auto& ptr = owner->obs_[node];
     if (!ptr) ptr = std::make_unique<Observer>(owner, node);
+    return static_cast<Observer&>(*ptr);
+  }
+  static void Forget(NodeLinkStore* owner, Node* node, Items::iterator link) noexcept {
+    auto itr = owner->obs_.find(node);
+    if (itr == owner->obs_.end()) return;
+
+    auto& links = static_cast<Observer&>(*itr->second).links_;
+    auto  found = std::find(links.begin(), links.end(), link);
+    if (found == links.end()) return;
+    *found = links.back();
+    links.pop_back();
   }
   Observer(NodeLinkStore* owner, Node* node) noexcept:
       Node::Observer(node), owner_(owner) {
   }
 
+  // only links of the target are checked
   void ObserveSockChange() noexcept override {
-    auto& items = owner_->items_;
-
-    auto itr  = items.begin();
-    auto term = items.end();
+    Index* idx = nullptr;  // taken when any link changes
 
-    while (itr < term) {
-      auto& in  = itr->in;
-      auto& out = itr->out;
+    for (size_t i = 0; i < links_.size();) {
+      auto& link = *links_[i];
 
-      if (in.node == target()) {
-        in.sock = target()->in(in.name);
-      }
-      if (out.node == target()) {
-        out.sock = target()->out(out.name);
+      auto in  = link.in.node == target()?  target()->in(link.in.name):   link.in.sock;
+      auto out = link.out.node == target()? target()->out(link.out.name): link.out.sock;
+      if (in && out && in == link.in.sock && out == link.out.sock) {
+        ++i;
+        continue;
       }
 
-      if (!in.sock || !out.sock) {
+      if (!idx) idx = &owner_->BeginEdit();
+      idx->Remove(link);
+      link.in.sock  = in;
+      link.out.sock = out;
+
+      if (in && out) {
+        idx->Add(link);
+        ++i;
+      } else {
         if (owner_->dead_listener_) {
-          owner_->dead_listener_(*itr);
+          owner_->dead_listener_(link);
         }
-        std::swap(*itr, *(--term));
-      } else {
-        ++itr;
+        owner_->Erase(links_[i]);  // links_[i] is replaced by the last one
       }
     }
-    items.erase(term, items.end());
+    if (idx) owner_->EndEdit();
   }
   void ObserveDie() noexcept override {
     // copy params on the stack because `this` will be deleted before escaping
@@ -57,16 +72,20 @@ class NodeLinkStore::Observer final : public Node::Observer {
     owner->obs_.erase(node);
   }
 
+  void Add(Items::iterator link) noexcept {
+    links_.push_back(link);
+  }
+
  private:
   NodeLinkStore* owner_;
+
+  std::vector<Items::iterator> links_;
 };
 
 NodeLinkStore::NodeLinkStore(std::vector<SockLink>&& items) noexcept :
-    items_(std::move(items)) {
-  for (auto link : items_) {
-    Observer::Register(this, link.in.node);
-    Observer::Register(this, link.out.node);
-  }
+    items_(std::make_move_iterator(items.begin()), std::make_move_iterator(items.end())) {
+  for (auto itr = items_.begin(); itr != items_.end(); ++itr) Adopt(itr);
+  Reindex();
 }
 
 std::vector<NodeLinkStore::SockLink> NodeLinkStore::DeserializeLinks(
@@ -128,8 +147,8 @@ void NodeLinkStore::Serialize(
     auto out_itr = idxmap.find(link.out.node);
     if (out_itr == idxmap.end()) continue;
 
-    pk.pack(std::make_tuple(in_itr->second, link.in.name,
-                            out_itr->second, link.out.name));
+    pk.pack(std::make_tuple(in_itr->second, link.in.name.str(),
+                            out_itr->second, link.out.name.str()));
   }
 }
 std::unique_ptr<NodeLinkStore> NodeLinkStore::Clone(
@@ -157,35 +176,143 @@ std::unique_ptr<NodeLinkStore> NodeLinkStore::Clone(
 }
 
 void NodeLinkStore::Link(InSock* in, OutSock* out) noexcept {
-  items_.emplace_back(in, out);
-  Observer::Register(this, in->owner());
-  Observer::Register(this, out->owner());
+  BeginEdit().Add(items_.emplace_back(in, out));
+  EndEdit();
+
+  Adopt(std::prev(items_.end()));
 }
 void NodeLinkStore::Unlink(const InSock* in, const OutSock* out) noexcept {
-  auto term = std::remove_if(items_.begin(), items_.end(),
-                             [in, out](auto& x) { return x.in.sock == in && x.out.sock == out; });
-  items_.erase(term, items_.end());
-}
-
-std::vector<NodeLinkStore::OutSock*> NodeLinkStore::GetSrcOf(const InSock* sock) const noexcept {
-  std::vector<OutSock*> ret;
-  for (const auto& link : items_) {
-    if (link.in.sock == sock) {
-      const auto& out = link.out;
-      ret.push_back(out.node->out(out.name));
+  auto& idx = BeginEdit();
+  for (auto itr = items_.begin(); itr != items_.end();) {
+    if (itr->in.sock == in && itr->out.sock == out) {
+      idx.Remove(*itr);
+      itr = Erase(itr);
+    } else {
+      ++itr;
     }
   }
-  return ret;
+  EndEdit();
 }
-std::vector<NodeLinkStore::InSock*> NodeLinkStore::GetDstOf(const OutSock* sock) const noexcept {
-  std::vector<InSock*> ret;
-  for (const auto& link : items_) {
-    if (link.out.sock == sock) {
-      const auto& in = link.in;
-      ret.push_back(in.node->in(in.name));
+void NodeLinkStore::SetParallel(bool v) noexcept {
+  if (parallel_ == v) return;
+  parallel_ = v;
+  BeginEdit();
+  EndEdit();
+}
+void NodeLinkStore::Adopt(Items::iterator itr) noexcept {
+  auto in_node  = itr->in.node;
+  auto out_node = itr->out.node;
+  if (in_node) Observer::Register(this, in_node).Add(itr);
+  if (out_node && out_node != in_node) Observer::Register(this, out_node).Add(itr);
+}
+NodeLinkStore::Items::iterator NodeLinkStore::Erase(Items::iterator itr) noexcept {
+  Observer::Forget(this, itr->in.node, itr);
+  if (itr->out.node != itr->in.node) Observer::Forget(this, itr->out.node, itr);
+  return items_.erase(itr);
+}
+void NodeLinkStore::Reindex() noexcept {
+  auto idx = std::make_shared<Index>();
+  for (const auto& link : items_) idx->Add(link);
+  Publish(std::move(idx));
+}
+void NodeLinkStore::Publish(std::shared_ptr<Index>&& idx) noexcept {
+  idx->parallel = parallel_;
+  index_.Store(std::move(idx));
+}
+NodeLinkStore::Index& NodeLinkStore::BeginEdit() noexcept {
+  if (!pending_) pending_ = std::make_shared<Index>(*index_.Load());
+  return *pending_;
+}
+void NodeLinkStore::EndEdit() noexcept {
+  if (edit_depth_ == 0 && pending_) Publish(std::exchange(pending_, nullptr));
+}
+void NodeLinkStore::Index::Add(const SockLink& link) noexcept {
+  if (!link.in.sock || !link.out.sock) return;
+  src[link.in.sock].push_back(link.out.sock);
+  dst[link.out.sock].push_back(link.in.sock);
+}
+void NodeLinkStore::Index::Remove(const SockLink& link) noexcept {
+  if (!link.in.sock || !link.out.sock) return;
+
+  // removes only one since the same link can be added twice
+  auto remove = [](auto& m, auto key, auto v) {
+    auto itr = m.find(key);
+    if (itr == m.end()) return;
+    auto& vec = itr->second;
+    auto  pos = std::find(vec.begin(), vec.end(), v);
+    if (pos != vec.end()) vec.erase(pos);
+    if (vec.empty()) m.erase(itr);
+  };
+  remove(src, link.in.sock, link.out.sock);
+  remove(dst, link.out.sock, link.in.sock);
+}
+std::span<const uint32_t> NodeLinkStore::Index::Split(const OutSock* sock) const noexcept {
+  {
+    std::shared_lock<std::shared_mutex> k(mtx_);
+    auto itr = branches_.find(sock);
+    if (itr != branches_.end()) return itr->second;
+  }
+  const auto& socks = dst.find(sock)->second;
+
+  std::vector<size_t> root(socks.size());
+  std::iota(root.begin(), root.end(), size_t {0});
+  auto find = [&root](size_t i) {
+    while (root[i] != i) i = root[i] = root[root[i]];
+    return i;
+  };
+
+  // the node -> index of the destination that reached it first
+  // (nullptr stands for the sending thread)
+  std::unordered_map<const Node*, size_t> reached;
+  std::vector<const Node*> stack;
+
+  auto reach = [&](const Node* n, size_t i) {
+    auto [itr, first] = reached.emplace(n, i);
+    if (!first) root[find(i)] = find(itr->second);
+    return first;
+  };
+
+  // Destinations reaching the same node are merged into one branch, and so
+  // are ones reaching nodes that are not re-entrant or pass values outside,
+  // which run in the sending thread. Nodes already reached are not walked
+  // again because nodes reachable from them have been reached too.
+  for (size_t i = 0; i < socks.size(); ++i) {
+    stack.push_back(socks[i]->owner());
+    while (stack.size()) {
+      auto n = stack.back();
+      stack.pop_back();
+
+      if (!reach(n, i)) continue;
+
+      const auto flags = n->flags();
+      if ((flags & Node::kExternal) || !(flags & Node::kReentrant)) {
+        reach(nullptr, i);
+      }
+
+      for (auto out : n->out()) {
+        auto d = dst.find(out);
+        if (d == dst.end()) continue;
+        for (auto in : d->second) stack.push_back(in->owner());
+      }
     }
   }
-  return ret;
+
+  // numbers branches in order of appearance but the sending thread's first
+  std::unordered_map<size_t, uint32_t> order;
+  if (auto itr = reached.find(nullptr); itr != reached.end()) {
+    order.emplace(find(itr->second), 0);
+  }
+  std::vector<uint32_t> ids;
+  ids.reserve(socks.size());
+  for (size_t i = 0; i < socks.size(); ++i) {
+    const auto n = static_cast<uint32_t>(order.size());
+    ids.push_back(order.emplace(find(i), n).first->second);
+  }
+  if (order.size() < 2) ids.clear();
+
+  // another thread may have done the same in the meantime
+  std::unique_lock<std::shared_mutex> k(mtx_);
+  return branches_.try_emplace(sock, std::move(ids)).first->second;
 }
 
 }  // namespace kingtaker
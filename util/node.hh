@@ -2,9 +2,13 @@
 
 #include "kingtaker.hh"
 
+#include <algorithm>
 #include <cassert>
 #include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <span>
 #include <string>
 #include <string_view>
@@ -20,6 +24,8 @@
 #include "util/history.hh"
 #include "util/node_logger.hh"
 #include "util/ptr_selector.hh"
+#include "util/snapshot.hh"
+#include "util/symbol.hh"
 #include "util/value.hh"
 
 
@@ -29,6 +35,7 @@ namespace kingtaker {
 class NodeLinkStore final {
  public:
   class SwapCommand;
+  class EditScope;
 
   using Node    = iface::Node;
   using Sock    = Node::Sock;
@@ -38,14 +45,14 @@ class NodeLinkStore final {
   template <typename T>
   struct SockRef final {
     SockRef() = default;
-    SockRef(T* s) noexcept : node(s->owner()), name(s->name()), sock(s) {
+    SockRef(T* s) noexcept : node(s->owner()), name(s->symbol()), sock(s) {
     }
     SockRef(Node* n, std::string_view na) noexcept :
         node(n), name(na), sock(nullptr) {
     }
-    Node*       node;
-    std::string name;
-    T*          sock;
+    Node*  node;
+    Symbol name;
+    T*     sock;
   };
   struct SockLink final {
     SockLink() = default;
@@ -54,6 +61,7 @@ class NodeLinkStore final {
     SockRef<InSock>  in;
     SockRef<OutSock> out;
   };
+  using Items = std::list<SockLink>;
 
   NodeLinkStore() = default;
   NodeLinkStore(const NodeLinkStore&) = delete;
@@ -75,23 +83,110 @@ class NodeLinkStore final {
     dead_listener_ = std::move(f);
   }
 
-  // deleted pointers can be passed
-  std::vector<OutSock*> GetSrcOf(const InSock* sock) const noexcept;
-  // deleted pointers can be passed
-  std::vector<InSock*> GetDstOf(const OutSock* out) const noexcept;
+  // When enabled, destinations of each socket are grouped into branches that
+  // never reach the same node, and OutSock delivers to them in parallel.
+  // Branches reaching nodes without Node::kReentrant or with Node::kExternal
+  // are joined together, and run in the sending thread.
+  void SetParallel(bool v) noexcept;
+  bool parallel() const noexcept { return parallel_; }
+
+  // thread-safe and deleted pointers can be passed
+  Node::SockList<OutSock> GetSrcOf(const InSock* sock) const noexcept {
+    auto idx = index_.Load();
+    auto itr = idx->src.find(sock);
+    if (itr == idx->src.end()) return {};
+    return {itr->second, std::move(idx)};
+  }
+  // thread-safe and deleted pointers can be passed
+  Node::SockList<InSock> GetDstOf(const OutSock* sock) const noexcept {
+    auto idx = index_.Load();
+    auto itr = idx->dst.find(sock);
+    if (itr == idx->dst.end()) return {};
+
+    std::span<const uint32_t> branches;
+    if (idx->parallel && itr->second.size() >= 2) branches = idx->Split(sock);
+    return {itr->second, std::move(idx), branches};
+  }
 
-  const std::vector<SockLink>& items() const noexcept { return items_; }
+  const Items& items() const noexcept { return items_; }
 
  private:
   DeadLinkListener dead_listener_;
 
-  std::vector<SockLink> items_;
+  bool parallel_ = false;
+
+  // a list to keep iterators held by observers valid
+  Items items_;
+
+  // Immutable indices of alive links in items_, which readers on any thread
+  // can access without locking. Edits publish a modified copy.
+  struct Index final {
+    std::unordered_map<const InSock*, std::vector<OutSock*>> src;
+    std::unordered_map<const OutSock*, std::vector<InSock*>> dst;
+
+    bool parallel = false;
+
+    Index() = default;
+    Index(const Index& other) noexcept :
+        src(other.src), dst(other.dst), parallel(other.parallel) {
+    }
+
+    void Add(const SockLink&) noexcept;
+    void Remove(const SockLink&) noexcept;
 
+    // Returns branch indices of items in dst of the socket, which are
+    // computed on the first call for each socket since the index is made,
+    // so edits never pay for sockets that nobody sends to.
+    std::span<const uint32_t> Split(const OutSock*) const noexcept;
+
+   private:
+    mutable std::shared_mutex mtx_;
+    mutable std::unordered_map<const OutSock*, std::vector<uint32_t>> branches_;
+  };
+  SnapshotPtr<Index> index_ = std::make_shared<const Index>();
+
+  // an index being edited while any EditScope is alive
+  std::shared_ptr<Index> pending_;
+  size_t                 edit_depth_ = 0;
+
+  // observers of linked nodes, which know links of the node
   class Observer;
   std::unordered_map<Node*, std::unique_ptr<Node::Observer>> obs_;
 
 
   NodeLinkStore(std::vector<SockLink>&& items) noexcept;
+
+  void Adopt(Items::iterator) noexcept;
+  Items::iterator Erase(Items::iterator) noexcept;
+
+  void Reindex() noexcept;
+  void Publish(std::shared_ptr<Index>&&) noexcept;
+
+  // Returns an index to modify, which is copied from the published one
+  // only once while EditScope is alive, and EndEdit() publishes it.
+  Index& BeginEdit() noexcept;
+  void EndEdit() noexcept;
+};
+
+// Defers publishing edits of links until the outermost scope ends, so that a
+// series of edits copies the index only once. Readers keep seeing the links
+// before the edits until then.
+class NodeLinkStore::EditScope final {
+ public:
+  EditScope(NodeLinkStore& links) noexcept : links_(&links) {
+    ++links_->edit_depth_;
+  }
+  ~EditScope() noexcept {
+    --links_->edit_depth_;
+    links_->EndEdit();
+  }
+  EditScope(const EditScope&) = delete;
+  EditScope(EditScope&&) = delete;
+  EditScope& operator=(const EditScope&) = delete;
+  EditScope& operator=(EditScope&&) = delete;
+
+ private:
+  NodeLinkStore* links_;
 };
 
 class NodeLinkStore::SwapCommand : public HistoryCommand {
@@ -99,14 +194,14 @@ class NodeLinkStore::SwapCommand : public HistoryCommand {
   enum Type { kLink, kUnlink, };
 
   SwapCommand(NodeLinkStore* links, Type t, const InSock& in, const OutSock& out) noexcept :
-      SwapCommand(links, t, in.owner(), in.name(), out.owner(), out.name()) {
+      SwapCommand(links, t, in.owner(), in.symbol(), out.owner(), out.symbol()) {
   }
   SwapCommand(NodeLinkStore* links, Type t, const SockLink& link) noexcept :
       SwapCommand(links, t, link.in.node, link.in.name, link.out.node, link.out.name) {
   }
   SwapCommand(NodeLinkStore* links, Type t,
-              Node* in_node,  std::string_view in_name,
-              Node* out_node, std::string_view out_name) noexcept :
+              Node* in_node,  Symbol in_name,
+              Node* out_node, Symbol out_name) noexcept :
       links_(links), type_(t),
       in_node_(in_node), in_name_(in_name),
       out_node_(out_node), out_name_(out_name) {
@@ -130,10 +225,10 @@ class NodeLinkStore::SwapCommand : public HistoryCommand {
 
   Type type_;
 
-  Node*       in_node_;
-  std::string in_name_;
-  Node*       out_node_;
-  std::string out_name_;
+  Node*  in_node_;
+  Symbol in_name_;
+  Node*  out_node_;
+  Symbol out_name_;
 
   void Link() const {
     auto in  = in_node_->in(in_name_);
@@ -181,6 +276,106 @@ class NodeRedirectContext : public iface::Node::Context {
 };
 
 
+// A pool of inner contexts that keeps released ones with their data, and
+// recycles them for the next call of the same target.
+// T must have target() and share the basepath of the parent.
+template <typename T>
+class NodeContextPool final {
+ public:
+  using Node    = iface::Node;
+  using Context = Node::Context;
+
+  // A pool belongs to one calling node and a released context keeps all data
+  // of its target, so only a few are kept: enough for calls in flight at once
+  // from forked branches or a caller switching among a handful of targets.
+  // Pop() scans them linearly, which is cheap at this size.
+  static constexpr size_t kMaxItems = 16;
+
+  NodeContextPool() noexcept : impl_(std::make_shared<Impl>()) {
+  }
+  NodeContextPool(const NodeContextPool&) = delete;
+  NodeContextPool(NodeContextPool&&) = delete;
+  NodeContextPool& operator=(const NodeContextPool&) = delete;
+  NodeContextPool& operator=(NodeContextPool&&) = delete;
+
+  // Returns a recycled context or a new one made by factory, which returns T*.
+  // The target is initialized with it unless all of its data can be reset.
+  template <typename F>
+  std::shared_ptr<T> Create(Node* target, const std::shared_ptr<Context>& octx, F&& factory) noexcept {
+    if (auto ptr = impl_->Pop(target)) {
+      ptr->Rebind(File::Path(octx->basepath()), octx);
+
+      std::shared_ptr<T> ret(ptr, Deleter {impl_});
+      if (!ret->ResetData(ret)) target->Initialize(ret);
+      return ret;
+    }
+    std::shared_ptr<T> ret(factory(), Deleter {impl_});
+    target->Initialize(ret);
+    return ret;
+  }
+
+ private:
+  class Impl final {
+   public:
+    Impl() = default;
+    ~Impl() noexcept {
+      for (auto ptr : items_) delete ptr;
+    }
+    Impl(const Impl&) = delete;
+    Impl(Impl&&) = delete;
+    Impl& operator=(const Impl&) = delete;
+    Impl& operator=(Impl&&) = delete;
+
+    T* Pop(Node* target) noexcept {
+      std::unique_lock<std::mutex> k(mtx_);
+      auto itr = std::find_if(items_.begin(), items_.end(),
+                              [target](auto x) { return x->target() == target; });
+      if (itr == items_.end()) return nullptr;
+
+      auto ret = *itr;
+      items_.erase(itr);
+      return ret;
+    }
+    // the oldest one is dropped when the pool is full
+    void Push(T* ptr) noexcept {
+      T* drop = nullptr;
+      {
+        std::unique_lock<std::mutex> k(mtx_);
+        if (items_.size() >= kMaxItems) {
+          drop = items_.front();
+          items_.erase(items_.begin());
+        }
+        items_.push_back(ptr);
+      }
+      delete drop;
+    }
+
+   private:
+    std::mutex mtx_;
+
+    std::vector<T*> items_;
+  };
+  std::shared_ptr<Impl> impl_;
+
+  struct Deleter final {
+    std::weak_ptr<Impl> impl;
+
+    void operator()(T* ptr) const noexcept {
+      // the parent is released outside of the lock
+      // because it may release other contexts of this pool
+      ptr->Unbind();
+
+      auto i = impl.lock();
+      if (i && ptr->target()) {
+        i->Push(ptr);
+      } else {
+        delete ptr;
+      }
+    }
+  };
+};
+
+
 // An implemetation of InSock that executes lambda when received something
 class NodeLambdaInSock final : public iface::Node::InSock {
  public:
@@ -212,6 +407,8 @@ class LambdaNodeDriver : public iface::Node::Context::Data {
 
   // static constexpr char* kTitle = "";
 
+  static constexpr Node::Flags kFlags = Node::kNone;
+
   using SockMeta = std::pair<std::string, std::string>;
   // static inline const std::vector<SockMeta> kInSocks;
   // static inline const std::vector<SockMeta> kOutSocks;
@@ -232,7 +429,7 @@ template <typename Driver>
 class LambdaNode final : public File, public iface::Node {
  public:
   LambdaNode(Env* env) noexcept :
-      File(&Driver::kType, env), Node(Node::kNone),
+      File(&Driver::kType, env), Node(Driver::kFlags),
       in_insts_(Driver::kInSocks.size()), out_insts_(Driver::kOutSocks.size()) {
     out_.reserve(Driver::kOutSocks.size());
     for (size_t i = 0; i < Driver::kOutSocks.size(); ++i) {
@@ -337,10 +534,10 @@ class NodeSockNameList final {
   NodeSockNameList() = default;
   NodeSockNameList(iface::Node* node) noexcept {
     in_.reserve(node->in().size());
-    for (auto sock : node->in()) in_.push_back(sock->name());
+    for (auto sock : node->in()) in_.push_back(sock->symbol());
 
     out_.reserve(node->out().size());
-    for (auto sock : node->out()) out_.push_back(sock->name());
+    for (auto sock : node->out()) out_.push_back(sock->symbol());
   }
   NodeSockNameList(const NodeSockNameList&) = default;
   NodeSockNameList(NodeSockNameList&&) = default;
@@ -354,29 +551,43 @@ class NodeSockNameList final {
     return other.in_ != in_ || other.out_ != out_;
   }
 
-  NodeSockNameList(const msgpack::object& obj) {
-    msgpack::find(obj, "in"s).convert(in_);
-    msgpack::find(obj, "out"s).convert(out_);
+  // names are stored as strings
+  NodeSockNameList(const msgpack::object& obj) :
+      in_(Intern(msgpack::find(obj, "in"s))), out_(Intern(msgpack::find(obj, "out"s))) {
   }
   void Serialize(Packer& pk) const noexcept {
     pk.pack_map(2);
 
     pk.pack("in"s);
-    pk.pack(in_);
+    Pack(pk, in_);
 
     pk.pack("out"s);
-    pk.pack(out_);
+    Pack(pk, out_);
   }
 
-  const std::string& in(size_t i) const noexcept { return in_[i]; }
-  const std::string& out(size_t i) const noexcept { return out_[i]; }
+  Symbol in(size_t i) const noexcept { return in_[i]; }
+  Symbol out(size_t i) const noexcept { return out_[i]; }
 
-  std::span<const std::string> in() const noexcept { return in_; }
-  std::span<const std::string> out() const noexcept { return out_; }
+  std::span<const Symbol> in() const noexcept { return in_; }
+  std::span<const Symbol> out() const noexcept { return out_; }
 
  private:
-  std::vector<std::string> in_;
-  std::vector<std::string> out_;
+  std::vector<Symbol> in_;
+  std::vector<Symbol> out_;
+
+
+  static std::vector<Symbol> Intern(const msgpack::object& obj) {
+    const auto strs = obj.as<std::vector<std::string>>();
+
+    std::vector<Symbol> ret;
+    ret.reserve(strs.size());
+    for (const auto& str : strs) ret.emplace_back(str);
+    return ret;
+  }
+  static void Pack(Packer& pk, const std::vector<Symbol>& syms) noexcept {
+    pk.pack_array(static_cast<uint32_t>(syms.size()));
+    for (auto sym : syms) pk.pack(sym.str());
+  }
 };
 
 }  // namespace kingtaker
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "util/value.hh"
+
+
+namespace kingtaker {
+
+// A result of Node/Cache: params passed to the target and values it emitted.
+class NodeCacheItem final {
+ public:
+  friend class NodeCacheStore;
+
+  using Param    = std::pair<std::string, Value>;
+  using Observer = std::function<void(std::string_view, const Value&)>;
+
+  void Observe(Observer&& obs) noexcept {
+    for (const auto& out : out_) {
+      obs(out.first, out.second);
+    }
+    if (!finished_) obs_.push_back(obs);
+  }
+  void Set(std::string_view name, Value&& v) noexcept {
+    assert(!finished_);
+
+    out_.emplace_back(name, v);
+    for (const auto& obs : obs_) {
+      obs(name, v);
+    }
+  }
+
+  // after calling this, Set() cannot be called
+  void Finish() noexcept {
+    obs_.clear();
+    finished_ = true;
+  }
+
+  const std::vector<Param>& in() const noexcept { return in_; }
+  const std::vector<Param>& out() const noexcept { return out_; }
+
+ private:
+  NodeCacheItem() = delete;
+  NodeCacheItem(std::vector<Param>&& in) noexcept : in_(std::move(in)) {
+  }
+
+  std::vector<Param> in_, out_;
+
+  std::vector<Observer> obs_;
+
+  bool finished_ = false;
+
+  // managed by NodeCacheStore
+  size_t hash_   = 0;
+  size_t bytes_  = 0;
+  bool   stored_ = false;
+  std::list<std::shared_ptr<NodeCacheItem>>::iterator lru_;
+};
+
+// Items are indexed by hash of the params, and the least recently used ones
+// are evicted when the total bytes of strings and tensors exceed the budget.
+// Only the sub queue touches the store.
+class NodeCacheStore final {
+ public:
+  using Param = NodeCacheItem::Param;
+
+  NodeCacheStore(size_t budget) noexcept : budget_(budget) { }
+
+  static size_t HashOf(const std::vector<Param>& params) noexcept {
+    size_t ret = params.size();
+    for (const auto& p : params) {
+      ret = ret*31 + std::hash<std::string>()(p.first);
+      ret = ret*31 + p.second.hash();
+    }
+    return ret;
+  }
+
+  std::shared_ptr<NodeCacheItem> Find(size_t hash, const std::vector<Param>& in) noexcept {
+    const auto [begin, end] = index_.equal_range(hash);
+    for (auto itr = begin; itr != end; ++itr) {
+      auto& item = *itr->second;
+      if (in == item->in()) {
+        lru_.splice(lru_.begin(), lru_, item->lru_);
+        return item;
+      }
+    }
+    return nullptr;
+  }
+  std::shared_ptr<NodeCacheItem> Allocate(size_t hash, std::vector<Param>&& in) noexcept {
+    std::shared_ptr<NodeCacheItem> item(new NodeCacheItem(std::move(in)));
+    item->hash_   = hash;
+    item->bytes_  = BytesOf(item->in());
+    item->stored_ = true;
+    item->lru_    = lru_.insert(lru_.begin(), item);
+    index_.emplace(hash, item->lru_);
+
+    bytes_ += item->bytes_;
+    Trim();
+    return item;
+  }
+  // sets an output of the item and counts its bytes if it's still stored
+  void Set(NodeCacheItem& item, std::string_view name, Value&& v) noexcept {
+    const auto n = name.size() + BytesOf(v);
+    item.Set(name, std::move(v));
+    item.bytes_ += n;
+    if (item.stored_) {
+      bytes_ += n;
+      Trim();
+    }
+  }
+  void Finish(NodeCacheItem& item) noexcept {
+    item.Finish();
+    if (item.stored_) Trim();
+  }
+  void DropAll() noexcept {
+    for (auto& item : lru_) item->stored_ = false;
+    lru_.clear();
+    index_.clear();
+    bytes_ = 0;
+  }
+  void SetBudget(size_t budget) noexcept {
+    budget_ = budget;
+    Trim();
+  }
+  void ClearStat() noexcept {
+    evict_cnt_ = 0;
+  }
+
+  size_t size() const noexcept { return lru_.size(); }
+  size_t bytes() const noexcept { return bytes_; }
+  size_t budget() const noexcept { return budget_; }
+  size_t evictCount() const noexcept { return evict_cnt_; }
+
+ private:
+  using List = std::list<std::shared_ptr<NodeCacheItem>>;
+
+  size_t budget_;
+
+  List lru_;  // the front is the most recently used
+  std::unordered_multimap<size_t, List::iterator> index_;
+
+  size_t bytes_     = 0;
+  size_t evict_cnt_ = 0;
+
+
+  // items being computed are kept to let their observers receive the rest,
+  // but their bytes are counted
+  void Trim() noexcept {
+    for (auto lru = lru_.end(); bytes_ > budget_ && lru != lru_.begin();) {
+      --lru;
+
+      auto& item = **lru;
+      if (!item.finished_) continue;
+
+      const auto [begin, end] = index_.equal_range(item.hash_);
+      auto itr = std::find_if(begin, end, [&](auto& x) { return &**x.second == &item; });
+      assert(itr != end);
+      index_.erase(itr);
+
+      item.stored_ = false;
+      bytes_ -= item.bytes_;
+      ++evict_cnt_;
+      lru = lru_.erase(lru);
+    }
+  }
+
+  static size_t BytesOf(const Value& v) noexcept {
+    if (v.isString()) return v.string().size();
+    if (v.isTensor()) return v.tensor().bytes();
+    if (v.isTuple()) {
+      size_t ret = 0;
+      for (const auto& e : v.tuple()) ret += BytesOf(e);
+      return ret;
+    }
+    return 0;
+  }
+  static size_t BytesOf(const std::vector<Param>& params) noexcept {
+    size_t ret = 0;
+    for (const auto& p : params) ret += p.first.size() + BytesOf(p.second);
+    return ret;
+  }
+};
+
+}  // namespace kingtaker
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace kingtaker::iface { class Node; }
+
+namespace kingtaker {
+
+// Collects run time and queue wait of each node for each context.
+// Nothing is recorded unless any Session is alive.
+//
+// Records are kept in tables of each thread and merged by Collect(),
+// so recording never contends with other threads.
+class NodeProfiler final {
+ public:
+  using Clock = std::chrono::steady_clock;
+  using Time  = Clock::time_point;
+  using Dur   = Clock::duration;
+
+  class Session;
+  class Scope;
+
+  // contexts exceeding this in a thread are merged into a nullptr context
+  static constexpr size_t kMaxEntries = 4096;
+
+  // histogram of nanoseconds that has 4 buckets for each power of 2
+  static constexpr size_t kBuckets = 64*4;
+
+  struct Stat final {
+   public:
+    void Add(Dur run, Dur wait) noexcept {
+      ++count;
+      total += run;
+      this->wait += wait;
+      ++hist[BucketOf(run)];
+    }
+    void Merge(const Stat& other) noexcept {
+      count += other.count;
+      total += other.total;
+      wait  += other.wait;
+      for (size_t i = 0; i < kBuckets; ++i) hist[i] += other.hist[i];
+    }
+
+    Dur mean() const noexcept {
+      return count? total/static_cast<Dur::rep>(count): Dur::zero();
+    }
+    Dur meanWait() const noexcept {
+      return count? wait/static_cast<Dur::rep>(count): Dur::zero();
+    }
+    // returns the upper bound of the bucket
+    Dur p99() const noexcept {
+      const auto th = count - count/100;
+
+      size_t n = 0;
+      for (size_t i = 0; i < kBuckets; ++i) {
+        n += hist[i];
+        if (n >= th) return std::chrono::nanoseconds(UpperOf(i));
+      }
+      return Dur::zero();
+    }
+
+    size_t count = 0;
+    Dur    total = Dur::zero();
+    Dur    wait  = Dur::zero();
+
+    size_t affinity = 0;
+    size_t depth    = 0;
+
+    std::array<uint32_t, kBuckets> hist = {};
+  };
+
+  // a stat of a node and breakdown by contexts
+  struct Report final {
+    Stat total;
+    std::vector<Stat> contexts;
+  };
+  using ReportMap = std::unordered_map<const iface::Node*, Report>;
+
+  static bool enabled() noexcept {
+    return sessions_.load(std::memory_order_relaxed);
+  }
+
+  static ReportMap Collect() noexcept {
+    ReportMap ret;
+
+    std::unique_lock<std::mutex> k(registry().mtx);
+    for (const auto& t : registry().tables) {
+      std::unique_lock<std::mutex> tk(t->mtx);
+      for (const auto& [key, stat] : t->items) {
+        auto& r = ret[key.first];
+        r.total.Merge(stat);
+        r.contexts.push_back(stat);
+      }
+    }
+    return ret;
+  }
+  static void Clear() noexcept {
+    std::unique_lock<std::mutex> k(registry().mtx);
+    for (const auto& t : registry().tables) {
+      std::unique_lock<std::mutex> tk(t->mtx);
+      t->items.clear();
+    }
+  }
+
+ private:
+  static inline std::atomic<size_t> sessions_ = 0;
+
+  using Key = std::pair<const iface::Node*, const void*>;
+  struct KeyHash final {
+    size_t operator()(const Key& k) const noexcept {
+      const auto a = reinterpret_cast<uintptr_t>(k.first);
+      const auto b = reinterpret_cast<uintptr_t>(k.second);
+      return std::hash<uintptr_t>()(a ^ (b*31));
+    }
+  };
+  struct Table final {
+    std::mutex mtx;  // locked by the owner thread and Collect()
+    std::unordered_map<Key, Stat, KeyHash> items;
+  };
+  struct Registry final {
+    std::mutex mtx;
+    std::vector<std::shared_ptr<Table>> tables;  // tables of exited threads are kept
+  };
+  static Registry& registry() noexcept {
+    static Registry r;
+    return r;
+  }
+  static Table& table() noexcept {
+    static thread_local std::shared_ptr<Table> t = []() {
+      auto ret = std::make_shared<Table>();
+      std::unique_lock<std::mutex> k(registry().mtx);
+      registry().tables.push_back(ret);
+      return ret;
+    }();
+    return *t;
+  }
+
+  static void Record(const iface::Node* n,
+                     const void*        ctx,
+                     size_t             affinity,
+                     size_t             depth,
+                     Dur                run,
+                     Dur                wait) noexcept {
+    auto& t = table();
+    std::unique_lock<std::mutex> k(t.mtx);
+
+    auto itr = t.items.find({n, ctx});
+    if (itr == t.items.end()) {
+      if (t.items.size() >= kMaxEntries) ctx = nullptr;
+      itr = t.items.try_emplace({n, ctx}).first;
+      itr->second.affinity = affinity;
+      itr->second.depth    = depth;
+    }
+    itr->second.Add(run, wait);
+  }
+
+  static size_t BucketOf(Dur d) noexcept {
+    const auto ns = static_cast<uint64_t>(
+        std::max(std::chrono::nanoseconds(d).count(), int64_t {0}));
+    if (ns < 4) return ns;
+
+    const auto b = static_cast<size_t>(std::bit_width(ns)-1);
+    return std::min(b*4 + ((ns >> (b-2)) & 3), kBuckets-1);
+  }
+  static uint64_t UpperOf(size_t idx) noexcept {
+    if (idx < 4) return idx;
+    const auto b = idx/4, sub = idx%4;
+    return (5+sub) << (b-2);
+  }
+};
+
+// Enables the profiler while alive.
+class NodeProfiler::Session final {
+ public:
+  Session() noexcept {
+    ++sessions_;
+  }
+  ~Session() noexcept {
+    --sessions_;
+  }
+  Session(const Session&) = delete;
+  Session(Session&&) = delete;
+  Session& operator=(const Session&) = delete;
+  Session& operator=(Session&&) = delete;
+};
+
+// Measures time until destruction as a run of the node, excluding time of
+// other scopes nested in the same thread.
+class NodeProfiler::Scope final {
+ public:
+  Scope(const iface::Node* n,
+        const void*        ctx,
+        size_t             affinity,
+        size_t             depth,
+        Time               sent) noexcept :
+      node_(n), ctx_(ctx), affinity_(affinity), depth_(depth),
+      begin_(Clock::now()),
+      wait_(sent == Time()? Dur::zero(): begin_-sent),
+      outer_nested_(std::exchange(nested_, Dur::zero())) {
+  }
+  ~Scope() noexcept {
+    const auto dur = Clock::now()-begin_;
+    Record(node_, ctx_, affinity_, depth_, dur-nested_, wait_);
+    nested_ = outer_nested_+dur;
+  }
+  Scope(const Scope&) = delete;
+  Scope(Scope&&) = delete;
+  Scope& operator=(const Scope&) = delete;
+  Scope& operator=(Scope&&) = delete;
+
+ private:
+  static inline thread_local Dur nested_ = Dur::zero();
+
+  const iface::Node* node_;
+  const void*        ctx_;
+  size_t             affinity_;
+  size_t             depth_;
+
+  Time begin_;
+  Dur  wait_;
+  Dur  outer_nested_;
+};
+
+}  // namespace kingtaker
@@ -2,102 +2,764 @@
 
 #include "kingtaker.hh"
 
+#include "util/tracer.hh"
+
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
+#include <cassert>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <deque>
 #include <functional>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <utility>
+#include <vector>
 
 
 namespace kingtaker {
 
+// Log-linear histogram of durations in HDR histogram style.
+// Each power of 2 is divided into kSub buckets,
+// so the relative error of a value is less than 1/kSub.
+class QueueHistogram final {
+ public:
+  static constexpr size_t kSubBits = 4;
+  static constexpr size_t kSub     = size_t {1} << kSubBits;
+  static constexpr size_t kMaxBits = 40;  // about 18 minutes in nanoseconds
+  static constexpr size_t kBuckets = (kMaxBits-kSubBits+1)*kSub;
+
+  using Counts = std::array<uint64_t, kBuckets>;
+
+  static size_t Index(uint64_t v) noexcept {
+    v = std::min(v, (uint64_t {1} << kMaxBits) - 1);
+    if (v < kSub) return static_cast<size_t>(v);
+
+    const auto e = static_cast<size_t>(std::bit_width(v)) - 1;
+    const auto s = static_cast<size_t>(v >> (e-kSubBits)) & (kSub-1);
+    return (e-kSubBits+1)*kSub + s;
+  }
+  // Returns the smallest value that falls into the bucket.
+  static uint64_t LowerBound(size_t idx) noexcept {
+    if (idx < kSub) return idx;
+
+    const auto e = idx/kSub + kSubBits - 1;
+    const auto s = idx%kSub;
+    return static_cast<uint64_t>(kSub+s) << (e-kSubBits);
+  }
+  // Returns a value at the percentile (0~1) of the counts.
+  static uint64_t Percentile(const Counts& c, double p) noexcept {
+    uint64_t total = 0;
+    for (auto n : c) total += n;
+    if (total == 0) return 0;
+
+    const auto target = static_cast<uint64_t>(p*static_cast<double>(total-1)) + 1;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      sum += c[i];
+      if (sum >= target) return LowerBound(i);
+    }
+    return LowerBound(kBuckets-1);
+  }
+  static uint64_t Total(const Counts& c) noexcept {
+    uint64_t ret = 0;
+    for (auto n : c) ret += n;
+    return ret;
+  }
+
+  QueueHistogram() = default;
+  QueueHistogram(const QueueHistogram&) = delete;
+  QueueHistogram(QueueHistogram&&) = delete;
+  QueueHistogram& operator=(const QueueHistogram&) = delete;
+  QueueHistogram& operator=(QueueHistogram&&) = delete;
+
+  void Record(std::chrono::nanoseconds d) noexcept {
+    const auto v = static_cast<uint64_t>(std::max(d.count(), decltype(d.count()) {0}));
+    counts_[Index(v)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Returns a copy of counts at this moment.
+  // Take differences of two snapshots to get the counts in the interval.
+  Counts Snapshot() const noexcept {
+    Counts ret;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      ret[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    return ret;
+  }
+
+ private:
+  std::array<std::atomic<uint64_t>, kBuckets> counts_ = {};
+};
+
+
+// Telemetry of a queue. Any operations are thread-safe.
+class QueueStats final {
+ public:
+  using SteadyClock = std::chrono::steady_clock;
+  using Dur         = std::chrono::nanoseconds;
+
+  // Returns all living instances.
+  static std::vector<const QueueStats*> instances() noexcept {
+    auto& reg = registry_();
+    std::unique_lock<std::mutex> _(reg.mtx);
+    return reg.items;
+  }
+
+  QueueStats(std::string_view name) noexcept : name_(name) {
+    auto& reg = registry_();
+    std::unique_lock<std::mutex> _(reg.mtx);
+    reg.items.push_back(this);
+  }
+  ~QueueStats() noexcept {
+    auto& reg = registry_();
+    std::unique_lock<std::mutex> _(reg.mtx);
+    reg.items.erase(std::remove(reg.items.begin(), reg.items.end(), this), reg.items.end());
+  }
+  QueueStats(const QueueStats&) = delete;
+  QueueStats(QueueStats&&) = delete;
+  QueueStats& operator=(const QueueStats&) = delete;
+  QueueStats& operator=(QueueStats&&) = delete;
+
+  // Durations are measured only while timed(), when any Session is alive or
+  // Tracer is enabled, so that tasks take no clock reads while nobody looks.
+  class Session;
+  static bool timed() noexcept {
+    return sessions_.load(std::memory_order_relaxed) || Tracer::enabled();
+  }
+  // Returns a push time to be stored with a task, which is zero if not timed.
+  static SteadyClock::time_point PushTime() noexcept {
+    return timed()? SteadyClock::now(): SteadyClock::time_point {};
+  }
+
+  void RecordPush() noexcept {
+    ++pushed_;
+  }
+  // Returns a start time to be passed to RecordEnd(),
+  // which is zero if the task is not timed.
+  SteadyClock::time_point RecordStart(SteadyClock::time_point pushed) noexcept {
+    started_.fetch_add(1, std::memory_order_relaxed);
+    if (pushed == SteadyClock::time_point {} || !timed()) return {};
+
+    const auto t0 = SteadyClock::now();
+    wait_.Record(t0-pushed);
+    return t0;
+  }
+  void RecordEnd(SteadyClock::time_point pushed, SteadyClock::time_point start) noexcept {
+    if (start != SteadyClock::time_point {}) {
+      const auto t1 = SteadyClock::now();
+      run_.Record(t1-start);
+      Trace(start, t1, start-pushed);
+    }
+    ++ended_;
+  }
+  // records a task span to Tracer while it's enabled
+  void Trace(SteadyClock::time_point begin,
+             SteadyClock::time_point end,
+             Dur                     wait) const noexcept {
+    if (!Tracer::enabled()) return;
+    Tracer::Record([&](auto& ev) {
+      ev.type  = Tracer::kTask;
+      ev.queue = name_.c_str();
+      ev.begin = begin;
+      ev.dur   = std::chrono::duration_cast<Tracer::Dur>(end-begin);
+      ev.wait  = std::chrono::duration_cast<Tracer::Dur>(wait);
+    });
+  }
+
+  const std::string& name() const noexcept { return name_; }
+
+  size_t pushed() const noexcept { return pushed_; }
+  size_t started() const noexcept { return started_.load(std::memory_order_relaxed); }
+  size_t ended() const noexcept { return ended_; }
+  size_t depth() const noexcept {
+    const auto s = started();
+    const auto p = pushed();
+    return p > s? p-s: 0;
+  }
+  // number of tasks queued or running
+  size_t active() const noexcept {
+    const auto e = ended();
+    const auto p = pushed();
+    return p > e? p-e: 0;
+  }
+
+  // enqueue-to-start durations
+  const QueueHistogram& wait() const noexcept { return wait_; }
+  // run durations
+  const QueueHistogram& run() const noexcept { return run_; }
+
+ private:
+  struct Registry final {
+    std::mutex mtx;
+    std::vector<const QueueStats*> items;
+  };
+  static Registry& registry_() noexcept {
+    static Registry reg;
+    return reg;
+  }
+
+  static inline std::atomic<size_t> sessions_ = 0;
+
+  std::string name_;
+
+  std::atomic<size_t> pushed_  = 0;
+  std::atomic<size_t> started_ = 0;
+  std::atomic<size_t> ended_   = 0;
+
+  QueueHistogram wait_;
+  QueueHistogram run_;
+};
+
+
+class QueueStats::Session final {
+ public:
+  Session() noexcept {
+    ++sessions_;
+  }
+  ~Session() noexcept {
+    --sessions_;
+  }
+  Session(const Session&) = delete;
+  Session(Session&&) = delete;
+  Session& operator=(const Session&) = delete;
+  Session& operator=(Session&&) = delete;
+};
+
+
+// A lock-free queue that allows multiple producers and only one consumer.
+// Pop() and Wait*() must be called from the same thread.
 class SimpleQueue : public Queue {
  public:
-  SimpleQueue() = default;
+  // on_wake is called from pushing thread when the queue gets non-empty
+  SimpleQueue(std::string_view name, void (*on_wake)() noexcept = nullptr) noexcept :
+      head_(&stub_), tail_(&stub_), on_wake_(on_wake), stats_(name) {
+  }
+  ~SimpleQueue() noexcept {
+    while (head_) {
+      auto next = head_->next.load(std::memory_order_relaxed);
+      if (head_ != &stub_) delete head_;
+      head_ = next;
+    }
+  }
 
   void Push(Task&& t) noexcept override {
-    std::unique_lock<std::mutex> _(mtx_);
-    q_.push_back(std::move(t));
-    ++cnt_;
-    cv_.notify_all();
+    auto n = NewNode(std::move(t));
+    stats_.RecordPush();
+
+    // count it up before linking so that pending() never misses the task
+    const bool was_empty = cnt_.fetch_add(1) == 0;
+    Link(n);
+
+    // the consumer needs a wake up only when it may be sleeping
+    if (was_empty) {
+      {
+        std::unique_lock<std::mutex> _(mtx_);
+        cv_.notify_all();
+      }
+      if (on_wake_) on_wake_();
+    }
   }
   bool Pop() {
-    std::unique_lock<std::mutex> k(mtx_);
-    if (q_.empty()) return false;
+    auto n = Unlink();
+    if (!n) return false;
 
     // take the task but not execute it yet because
     // it must be popped even if it throws an exception
-    auto task = std::move(q_.front());
-    q_.pop_front();
+    auto task = std::move(n->task);
+    const auto pushed = n->pushed;
+    DeleteNode(n);
     --cnt_;
 
-    k.unlock();
-    task();
+    const auto t0 = stats_.RecordStart(pushed);
+    try {
+      task();
+    } catch (...) {
+      stats_.RecordEnd(pushed, t0);
+      throw;
+    }
+    stats_.RecordEnd(pushed, t0);
     return true;
   }
 
+  // Wait*() return immediately when any task is pending.
   void Wait() noexcept {
     std::unique_lock<std::mutex> k(mtx_);
-    cv_.wait(k);
+    cv_.wait(k, [this]() { return Awake(); });
   }
   template <typename Dur>
   void WaitFor(const Dur& dur) noexcept {
     std::unique_lock<std::mutex> k(mtx_);
-    cv_.wait_for(k, dur);
+    cv_.wait_for(k, dur, [this]() { return Awake(); });
   }
   template <typename Time>
   void WaitUntil(const Time& t) noexcept {
     std::unique_lock<std::mutex> k(mtx_);
-    cv_.wait_until(k, t);
+    cv_.wait_until(k, t, [this]() { return Awake(); });
   }
   void Wake() noexcept {
+    std::unique_lock<std::mutex> _(mtx_);
+    wake_ = true;
     cv_.notify_all();
   }
 
   bool pending() const noexcept {
     return cnt_ > 0;
   }
+  size_t size() const noexcept {
+    return cnt_;
+  }
+  const QueueStats& stats() const noexcept { return stats_; }
 
  private:
-  std::mutex mtx_;
+  struct Node final {
+    std::atomic<Node*> next = nullptr;
+
+    Task task;
+
+    QueueStats::SteadyClock::time_point pushed;
+  };
+
+  // only the consumer touches head_
+  Node* head_;
+
+  std::atomic<Node*> tail_;
+
+  Node stub_;
 
+  std::atomic<size_t> cnt_ = 0;
+
+  std::mutex              mtx_;
   std::condition_variable cv_;
 
-  std::atomic<size_t> cnt_;
+  bool wake_ = false;  // guarded by mtx_
+
+  void (*on_wake_)() noexcept;
+
+  QueueStats stats_;
+
+
+  void Link(Node* n) noexcept {
+    auto prev = tail_.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+  // Returns nullptr when the queue is empty or a producer is in the middle of
+  // linking. In the latter case, pending() keeps true until the next Pop().
+  Node* Unlink() noexcept {
+    auto head = head_;
+    auto next = head->next.load(std::memory_order_acquire);
+    if (head == &stub_) {
+      if (!next) return nullptr;
+      head_ = head = next;
+      next  = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      head_ = next;
+      return head;
+    }
+    if (head != tail_.load(std::memory_order_acquire)) return nullptr;
+
+    // head is the last node, so push the stub back to unlink head
+    stub_.next.store(nullptr, std::memory_order_relaxed);
+    Link(&stub_);
+
+    next = head->next.load(std::memory_order_acquire);
+    if (!next) return nullptr;
+    head_ = next;
+    return head;
+  }
+
+  bool Awake() noexcept {
+    return cnt_ > 0 || std::exchange(wake_, false);
+  }
+
+  // Nodes are recycled through a cache of the thread that popped them.
+  // Since most tasks are pushed by the consumer thread itself,
+  // the allocation rarely happens in a steady state.
+  static constexpr size_t kNodeCacheSize = 1024;
+  struct NodeCache final {
+    ~NodeCache() noexcept {
+      for (auto n : nodes) delete n;
+    }
+    std::vector<Node*> nodes;
+  };
+  static std::vector<Node*>& nodeCache() noexcept {
+    static thread_local NodeCache cache;
+    return cache.nodes;
+  }
+  static Node* NewNode(Task&& t) noexcept {
+    auto& cache = nodeCache();
+    const auto now = QueueStats::PushTime();
+    if (cache.empty()) return new Node {nullptr, std::move(t), now};
 
-  std::deque<Task> q_;
+    auto n = cache.back();
+    cache.pop_back();
+    n->next.store(nullptr, std::memory_order_relaxed);
+    n->task   = std::move(t);
+    n->pushed = now;
+    return n;
+  }
+  static void DeleteNode(Node* n) noexcept {
+    auto& cache = nodeCache();
+    if (cache.size() >= kNodeCacheSize) {
+      delete n;
+    } else {
+      n->task = nullptr;
+      cache.push_back(n);
+    }
+  }
 };
 
 
-class CpuQueue : public SimpleQueue {
+// A thread pool that has a task deque for each worker.
+// A worker takes tasks from the front of its own deque firstly,
+// and steals from the front of other workers' deque when its own is empty,
+// so tasks in each deque start in pushed order.
+class CpuQueue : public Queue {
  public:
   CpuQueue() = delete;
-  CpuQueue(size_t n = 2) noexcept : th_(n) {
-    for (auto& t : th_) t = std::thread([this] () { Main(); });
+  CpuQueue(size_t n, std::string_view name = "cpu") noexcept :
+      n_(std::max(n, size_t {1})), workers_(std::make_unique<Worker[]>(n_)),
+      stats_(name) {
+    for (size_t i = 0; i < n_; ++i) {
+      workers_[i].th = std::thread([this, i]() { Main(i); });
+    }
   }
 
   ~CpuQueue() noexcept {
-    alive_ = false;
-    Wake();
-    for (auto& t : th_) t.join();
+    {
+      std::unique_lock<std::mutex> _(mtx_);
+      alive_ = false;
+    }
+    cv_.notify_all();
+    for (size_t i = 0; i < n_; ++i) workers_[i].th.join();
+  }
+
+  void Push(Task&& t) noexcept override {
+    // tasks pushed from a worker of this pool go to its own deque
+    // to keep the data used by them hot in the cache
+    // and others are spread by a counter of the pushing thread,
+    // not to make pushing threads contend on a shared one
+    const auto idx = self_ == this? self_idx_: next_++%n_;
+
+    // counted before published, or a worker taking it at once could
+    // make the depth negative
+    stats_.RecordPush();
+
+    auto& w = workers_[idx];
+    {
+      std::unique_lock<std::mutex> _(w.mtx);
+      w.q.push_back({std::move(t), QueueStats::PushTime()});
+    }
+    if (sleeping_ > 0) {
+      std::unique_lock<std::mutex> _(mtx_);
+      cv_.notify_one();
+    }
+  }
+
+  bool pending() const noexcept {
+    return stats_.depth() > 0;
   }
+  size_t threads() const noexcept { return n_; }
+  const QueueStats& stats() const noexcept { return stats_; }
 
  private:
-  void Main() noexcept {
-    while (alive_) {
-      while (Pop());
-      Wait();
+  struct Item final {
+    Task task;
+
+    QueueStats::SteadyClock::time_point pushed;
+  };
+  struct Worker final {
+    std::mutex       mtx;
+    std::deque<Item> q;
+    std::thread      th;
+  };
+
+  static constexpr size_t kSpins = 64;
+
+  // identifies the worker running on the current thread
+  static inline thread_local const CpuQueue* self_     = nullptr;
+  static inline thread_local size_t          self_idx_ = 0;
+
+  size_t n_;
+
+  std::unique_ptr<Worker[]> workers_;
+
+  static inline thread_local size_t next_ = 0;
+
+  // the number of pending tasks is the depth of stats_
+  std::atomic<size_t> sleeping_ = 0;
+
+  std::mutex              mtx_;
+  std::condition_variable cv_;
+
+  bool alive_ = true;  // guarded by mtx_
+
+  QueueStats stats_;
+
+
+  void Main(size_t idx) noexcept {
+    self_     = this;
+    self_idx_ = idx;
+    Tracer::NameThread(stats_.name().c_str());
+
+    std::unique_lock<std::mutex> k(mtx_, std::defer_lock);
+    for (;;) {
+      if (Pop(idx)) continue;
+
+      // yields a few times before sleeping, since waking a sleeping worker
+      // costs the pushing thread much more than a task
+      size_t spin = 0;
+      while (spin < kSpins && !pending()) {
+        std::this_thread::yield();
+        ++spin;
+      }
+      if (spin < kSpins) continue;
+
+      k.lock();
+      ++sleeping_;
+      cv_.wait(k, [this]() { return !alive_ || pending(); });
+      --sleeping_;
+      if (!alive_) return;
+      k.unlock();
     }
   }
+  bool Pop(size_t idx) noexcept {
+    Item item;
+    if (!Take(idx, item)) return false;
 
+    const auto t0 = stats_.RecordStart(item.pushed);
+    item.task();
+    stats_.RecordEnd(item.pushed, t0);
+    return true;
+  }
 
-  std::atomic<bool> alive_ = true;
+  // Takes a task from its own deque or steals one from others. Deques
+  // contended at the first try are locked at the second, so that a worker
+  // never spins on pending tasks skipped as locked.
+  bool Take(size_t idx, Item& t) noexcept {
+    if (TakeFront(workers_[idx], t)) return true;
 
-  std::vector<std::thread> th_;
+    bool contended = false;
+    for (size_t i = 1; i < n_; ++i) {
+      if (TakeFront(workers_[(idx+i)%n_], t, &contended)) return true;
+    }
+    if (!contended) return false;
+    for (size_t i = 1; i < n_; ++i) {
+      if (TakeFront(workers_[(idx+i)%n_], t)) return true;
+    }
+    return false;
+  }
+  // only tries to lock when contended is passed, and sets it if failed
+  static bool TakeFront(Worker& w, Item& t, bool* contended = nullptr) noexcept {
+    std::unique_lock<std::mutex> k(w.mtx, std::defer_lock);
+    if (contended) {
+      if (!k.try_lock()) {
+        *contended = true;
+        return false;
+      }
+    } else {
+      k.lock();
+    }
+    if (w.q.empty()) return false;
+    t = std::move(w.q.front());
+    w.q.pop_front();
+    return true;
+  }
 };
 
-}  // namespace kingtaker
 
+// Hierarchical timing wheel that pushes tasks into queues at their deadlines
+// from a dedicated thread, in microsecond resolution.
+// Each level has 256 slots and a slot of level L covers 256^L ticks,
+// so 6 levels cover about 8.9 years.
+class TimerWheel final {
+ public:
+  using Tick = uint64_t;  // micro seconds since the wheel is created
+  using Time = std::chrono::steady_clock::time_point;
+
+  static constexpr size_t kBits   = 8;
+  static constexpr size_t kSlots  = size_t {1} << kBits;
+  static constexpr size_t kLevels = 6;
+
+  TimerWheel() noexcept : epoch_(std::chrono::steady_clock::now()) {
+    th_ = std::thread([this]() { Main(); });
+  }
+  ~TimerWheel() noexcept {
+    {
+      std::unique_lock<std::mutex> _(mtx_);
+      alive_ = false;
+    }
+    cv_.notify_all();
+    th_.join();
+  }
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel(TimerWheel&&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+  TimerWheel& operator=(TimerWheel&&) = delete;
+
+  void Push(Time t, Queue& q, Queue::Task&& task) noexcept {
+    const auto d = ToTick(t);
+    std::unique_lock<std::mutex> k(mtx_);
+    if (d <= now_) {
+      k.unlock();
+      q.Push(std::move(task));
+      return;
+    }
+    ++cnt_;
+    Insert({d, &q, std::move(task)});
+    if (d < wake_) cv_.notify_one();
+  }
+
+  // number of tasks not pushed into queues yet
+  size_t size() const noexcept { return cnt_; }
+
+ private:
+  struct Item final {
+    Tick d;
+
+    Queue* q;
+    Queue::Task task;
+  };
+  struct Level final {
+    std::array<std::vector<Item>, kSlots> slots;
+    std::array<uint64_t, kSlots/64> bits = {};
+
+    bool empty() const noexcept {
+      for (auto b : bits) if (b) return false;
+      return true;
+    }
+    // Returns the first non-empty slot after i, or kSlots if not found.
+    size_t FindAfter(size_t i) const noexcept {
+      for (++i; i < kSlots; i = (i/64+1)*64) {
+        const auto b = bits[i/64] >> (i%64);
+        if (b) return i + static_cast<size_t>(std::countr_zero(b));
+      }
+      return kSlots;
+    }
+  };
+
+  const Time epoch_;
+
+  std::thread             th_;
+  std::mutex              mtx_;
+  std::condition_variable cv_;
+
+  // guarded by mtx_
+  bool  alive_ = true;
+  Tick  now_   = 0;
+  Tick  wake_  = 0;  // tick that the thread sleeps until
+  std::array<Level, kLevels> levels_;
+
+  std::atomic<size_t> cnt_ = 0;
+
+
+  Tick ToTick(Time t) const noexcept {
+    if (t <= epoch_) return 0;
+    // rounds up not to fire earlier than the deadline
+    return static_cast<Tick>(
+        std::chrono::ceil<std::chrono::microseconds>(t-epoch_).count());
+  }
+  Tick NowTick() const noexcept {
+    return static_cast<Tick>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now()-epoch_).count());
+  }
+  Time ToTime(Tick t) const noexcept {
+    return epoch_ + std::chrono::microseconds(t);
+  }
+
+  static size_t Digit(Tick t, size_t lv) noexcept {
+    return static_cast<size_t>(t >> (lv*kBits)) & (kSlots-1);
+  }
+
+  // An item is placed on the level of the highest digit that differs from
+  // now_, so items on level L share the digits above L with now_ and
+  // must be moved to lower levels when now_ reaches the slot.
+  void Insert(Item&& item) noexcept {
+    assert(item.d > now_);
+    const auto diff = static_cast<size_t>(std::bit_width(item.d ^ now_)) - 1;
+    const auto lv   = std::min(diff/kBits, kLevels-1);
+    const auto idx  = Digit(item.d, lv);
+
+    auto& l = levels_[lv];
+    l.slots[idx].push_back(std::move(item));
+    l.bits[idx/64] |= uint64_t {1} << (idx%64);
+  }
+
+  // Returns the tick that the next slot is reached, or 0 if no items.
+  Tick NextEvent() const noexcept {
+    for (size_t lv = 0; lv < kLevels; ++lv) {
+      const auto& l = levels_[lv];
+      if (l.empty()) continue;
+
+      const auto idx   = l.FindAfter(Digit(now_, lv));
+      const auto shift = lv*kBits;
+      const auto upper = shift+kBits < 64? (now_ >> (shift+kBits)) << (shift+kBits): 0;
+      return upper | (static_cast<Tick>(idx) << shift);
+    }
+    return 0;
+  }
+
+  // Advances now_ to the tick and collects expired items.
+  void Advance(Tick t, std::vector<Item>& expired) noexcept {
+    for (;;) {
+      const auto e = NextEvent();
+      if (e == 0 || e > t) break;
+
+      now_ = e;
+      for (size_t lv = 0; lv < kLevels; ++lv) {
+        auto& l   = levels_[lv];
+        auto  idx = Digit(now_, lv);
+        if (!(l.bits[idx/64] & (uint64_t {1} << (idx%64)))) continue;
+
+        l.bits[idx/64] &= ~(uint64_t {1} << (idx%64));
+        auto items = std::move(l.slots[idx]);
+        l.slots[idx].clear();
+        for (auto& item : items) {
+          if (item.d <= now_) {
+            expired.push_back(std::move(item));
+          } else {
+            Insert(std::move(item));
+          }
+        }
+        break;
+      }
+    }
+    now_ = std::max(now_, t);
+  }
+
+  void Main() noexcept {
+    std::vector<Item> expired;
+
+    std::unique_lock<std::mutex> k(mtx_);
+    while (alive_) {
+      const auto e = NextEvent();
+      wake_ = e? e: std::numeric_limits<Tick>::max();
+      if (e) {
+        cv_.wait_until(k, ToTime(e));
+      } else {
+        cv_.wait(k);
+      }
+      Advance(NowTick(), expired);
+      if (expired.empty()) continue;
+
+      k.unlock();
+      for (auto& item : expired) {
+        item.q->Push(std::move(item.task));
+        --cnt_;
+      }
+      expired.clear();
+      k.lock();
+    }
+  }
+};
+
+}  // namespace kingtaker
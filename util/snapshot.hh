@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+
+namespace kingtaker {
+
+// Holds an immutable object that writers replace as a whole (RCU style).
+// Readers take the current version without waiting for writers,
+// and the version is kept alive while they hold it.
+template <typename T>
+class SnapshotPtr final {
+ public:
+  using Ptr = std::shared_ptr<const T>;
+
+  SnapshotPtr(Ptr&& p = nullptr) noexcept : ptr_(std::move(p)) {
+  }
+  SnapshotPtr(const SnapshotPtr&) = delete;
+  SnapshotPtr(SnapshotPtr&&) = delete;
+  SnapshotPtr& operator=(const SnapshotPtr&) = delete;
+  SnapshotPtr& operator=(SnapshotPtr&&) = delete;
+
+#if defined(__cpp_lib_atomic_shared_ptr)
+  Ptr Load() const noexcept {
+    return ptr_.load(std::memory_order_acquire);
+  }
+  void Store(Ptr&& p) noexcept {
+    ptr_.store(std::move(p), std::memory_order_release);
+  }
+
+ private:
+  std::atomic<Ptr> ptr_;
+
+#else
+  // the spin lock is held only while copying the pointer
+  Ptr Load() const noexcept {
+    Lock();
+    auto ret = ptr_;
+    Unlock();
+    return ret;
+  }
+  void Store(Ptr&& p) noexcept {
+    Lock();
+    std::swap(ptr_, p);
+    Unlock();
+  }
+
+ private:
+  mutable std::atomic_flag lock_;
+
+  Ptr ptr_;
+
+  void Lock() const noexcept {
+    while (lock_.test_and_set(std::memory_order_acquire)) lock_.wait(true);
+  }
+  void Unlock() const noexcept {
+    lock_.clear(std::memory_order_release);
+    lock_.notify_one();
+  }
+#endif
+};
+
+}  // namespace kingtaker
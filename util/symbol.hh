@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace kingtaker {
+
+// An interned string that is compared and hashed as an integer.
+// Interned strings are never released, so use it only for names that have
+// limited variations, such as socket names.
+class Symbol final {
+ public:
+  using Id = uint32_t;
+
+  struct Hash final {
+    size_t operator()(Symbol s) const noexcept { return s.id(); }
+  };
+
+  // Returns a null symbol when the string has never been interned.
+  // Nothing is interned by this.
+  static Symbol Find(std::string_view str) noexcept {
+    return Symbol(Lookup(str));
+  }
+
+  Symbol() = default;
+  explicit Symbol(std::string_view str) noexcept : entry_(Intern(str)) {
+  }
+  Symbol(const Symbol&) = default;
+  Symbol(Symbol&&) = default;
+  Symbol& operator=(const Symbol&) = default;
+  Symbol& operator=(Symbol&&) = default;
+
+  bool operator==(const Symbol& other) const noexcept { return entry_ == other.entry_; }
+  bool operator!=(const Symbol& other) const noexcept { return entry_ != other.entry_; }
+
+  explicit operator bool() const noexcept { return entry_; }
+
+  // the null symbol has an id 0
+  Id id() const noexcept { return entry_? entry_->id: 0; }
+  const std::string& str() const noexcept {
+    static const std::string kEmpty;
+    return entry_? entry_->str: kEmpty;
+  }
+
+ private:
+  struct Entry final {
+    Id          id;
+    std::string str;
+  };
+  // An open addressing table that readers probe without locking. Writers fill
+  // empty slots, and replace the table with a twice larger one when it gets
+  // half full. Replaced tables are kept because readers may still be probing
+  // them, but they sum up to less than the current one.
+  struct Slots final {
+    explicit Slots(size_t n) noexcept :
+        mask(n-1), items(std::make_unique<std::atomic<const Entry*>[]>(n)) {
+    }
+
+    size_t mask;
+    std::unique_ptr<std::atomic<const Entry*>[]> items;
+
+    size_t used = 0;  // touched only by writers
+  };
+  struct Table final {
+    static constexpr size_t kInitialSlots = 256;
+
+    Table() noexcept {
+      slots.push_back(std::make_unique<Slots>(kInitialSlots));
+      current.store(slots.back().get(), std::memory_order_release);
+    }
+
+    std::mutex mtx;  // for writers
+
+    std::deque<Entry> entries;  // deque never moves the items
+
+    std::vector<std::unique_ptr<Slots>> slots;  // the last one is current
+    std::atomic<const Slots*> current;
+  };
+  static Table& table() noexcept {
+    static Table t;
+    return t;
+  }
+
+  static const Entry* Lookup(std::string_view str) noexcept {
+    const auto& s = *table().current.load(std::memory_order_acquire);
+    for (auto i = std::hash<std::string_view>()(str);; ++i) {
+      const auto e = s.items[i & s.mask].load(std::memory_order_acquire);
+      if (!e || e->str == str) return e;
+    }
+  }
+  static const Entry* Intern(std::string_view str) noexcept {
+    if (auto e = Lookup(str)) return e;
+
+    auto& t = table();
+    std::unique_lock<std::mutex> k(t.mtx);
+    if (auto e = Lookup(str)) return e;  // interned by another thread
+
+    const auto& e = t.entries.emplace_back(
+        Entry {static_cast<Id>(t.entries.size()+1), std::string(str)});
+
+    auto& cur = *t.slots.back();
+    if ((cur.used+1)*2 <= cur.mask+1) {
+      Fill(cur, e);
+    } else {
+      auto next = std::make_unique<Slots>((cur.mask+1)*2);
+      for (const auto& x : t.entries) Fill(*next, x);
+      t.current.store(next.get(), std::memory_order_release);
+      t.slots.push_back(std::move(next));
+    }
+    return &e;
+  }
+  static void Fill(Slots& s, const Entry& e) noexcept {
+    auto i = std::hash<std::string_view>()(e.str);
+    while (s.items[i & s.mask].load(std::memory_order_relaxed)) ++i;
+    s.items[i & s.mask].store(&e, std::memory_order_release);
+    ++s.used;
+  }
+
+  Symbol(const Entry* e) noexcept : entry_(e) {
+  }
+
+  const Entry* entry_ = nullptr;
+};
+
+}  // namespace kingtaker
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/symbol.hh"
+
+
+namespace kingtaker {
+
+// Records events of node messages and queue tasks while started.
+// Each thread writes to its own ring buffer without locking, and the oldest
+// events are overwritten when it's full. Snapshot() can be called only while
+// stopped.
+class Tracer final {
+ public:
+  using Clock = std::chrono::steady_clock;
+  using Time  = Clock::time_point;
+  using Dur   = Clock::duration;
+
+  static constexpr size_t kCapacity = size_t {1} << 14;  // for each thread
+
+  enum Type : uint8_t {
+    kSend,     // an instant when a node sends a value
+    kReceive,  // a span of a node handling a value
+    kTask,     // a span of a queue task
+  };
+  struct Event final {
+    Type type;
+
+    // name of socket or queue
+    Symbol sock;
+    const char* queue;
+
+    // node path is resolved when the filesystem is locked, otherwise the node
+    // pointer and File::generation() are kept to resolve it later
+    std::shared_ptr<const std::string> path;
+    const void* node;
+    uint64_t    generation;
+
+    size_t      depth;
+    const char* vtype;  // Value::StringifyType()
+
+    // shared by a send and receives caused by it
+    uint64_t flow;
+
+    Time begin;
+    Dur  dur;
+    Dur  wait;
+  };
+  struct Thread final {
+    size_t             tid;
+    std::string        name;
+    std::vector<Event> events;  // in recorded order
+  };
+
+  static bool enabled() noexcept {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  // Clears the previous records and starts recording.
+  static void Start() noexcept {
+    std::unique_lock<std::mutex> k(registry().mtx);
+    if (enabled()) return;
+    for (auto& r : registry().rings) r->next = 0;
+    enabled_.store(true);
+  }
+  // Stops and waits for recording threads.
+  static void Stop() noexcept {
+    std::unique_lock<std::mutex> k(registry().mtx);
+    enabled_.store(false);
+    for (auto& r : registry().rings) {
+      while (r->writing.load()) std::this_thread::yield();
+    }
+  }
+
+  static std::vector<Thread> Snapshot() noexcept {
+    std::unique_lock<std::mutex> k(registry().mtx);
+    assert(!enabled());
+
+    std::vector<Thread> ret;
+    for (auto& r : registry().rings) {
+      if (!r->next) continue;
+
+      Thread th;
+      th.tid  = r->tid;
+      th.name = r->name.load()? r->name.load(): "thread#"+std::to_string(r->tid);
+
+      const auto n = std::min(r->next, kCapacity);
+      th.events.reserve(n);
+      for (auto i = r->next-n; i < r->next; ++i) {
+        th.events.push_back(r->events[i%kCapacity]);
+      }
+      ret.push_back(std::move(th));
+    }
+    return ret;
+  }
+
+  // Names the current thread, and the name must be alive until the app exits.
+  static void NameThread(const char* name) noexcept {
+    auto& r = ring();
+    if (!r.name.load(std::memory_order_relaxed)) r.name.store(name);
+  }
+
+  // Fills a new event by f. Call only when enabled() is true.
+  template <typename F>
+  static void Record(F&& f) noexcept {
+    auto& r = ring();
+
+    // paired with Stop() to let it know a writer is in the ring
+    r.writing.store(true);
+    if (enabled_.load()) {
+      if (!r.events) r.events = std::make_unique<Event[]>(kCapacity);
+      auto& ev = r.events[r.next%kCapacity];
+      ev = {};
+      f(ev);
+      ++r.next;
+    }
+    r.writing.store(false, std::memory_order_release);
+  }
+
+  // Returns an id unique in the process to link events by flow.
+  static uint64_t NewFlow() noexcept {
+    auto& r = ring();
+    return (static_cast<uint64_t>(r.tid) << 40) | ++r.flow;
+  }
+
+ private:
+  static inline std::atomic<bool> enabled_ = false;
+
+  struct Ring final {
+    std::atomic<bool> writing = false;
+    std::atomic<const char*> name = nullptr;
+
+    size_t   tid;
+    uint64_t flow = 0;
+
+    // touched only by the owner thread while enabled
+    size_t next = 0;
+    std::unique_ptr<Event[]> events;
+  };
+  struct Registry final {
+    std::mutex mtx;
+    std::vector<std::shared_ptr<Ring>> rings;  // rings of exited threads are kept
+  };
+  static Registry& registry() noexcept {
+    static Registry r;
+    return r;
+  }
+  static Ring& ring() noexcept {
+    static thread_local std::shared_ptr<Ring> r = []() {
+      auto ret = std::make_shared<Ring>();
+
+      std::unique_lock<std::mutex> k(registry().mtx);
+      ret->tid = registry().rings.size();
+      registry().rings.push_back(ret);
+      return ret;
+    }();
+    return *r;
+  }
+};
+
+}  // namespace kingtaker
@@ -1,10 +1,59 @@
 #include "util/value.hh"
 
+#include <bit>
+#include <cstring>
+
 #include <msgpack.hh>
 
 
 namespace kingtaker {
 
+static constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87;
+static constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4F;
+
+static uint64_t Mix(uint64_t h) noexcept {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCD;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53;
+  h ^= h >> 33;
+  return h;
+}
+static uint64_t HashCombine(uint64_t h, uint64_t v) noexcept {
+  return Mix(h ^ (v*kPrime1 + kPrime2 + (h << 6) + (h >> 2)));
+}
+// The main loop takes 32 bytes into 4 independent lanes,
+// so the compiler can vectorize it.
+static uint64_t HashBytes(std::span<const uint8_t> buf, uint64_t seed) noexcept {
+  const auto n = buf.size();
+  const auto p = buf.data();
+
+  uint64_t lane[4] = {seed+kPrime1+kPrime2, seed+kPrime2, seed, seed-kPrime1};
+
+  size_t i = 0;
+  for (; i+32 <= n; i += 32) {
+    uint64_t w[4];
+    std::memcpy(w, p+i, sizeof(w));
+    for (size_t j = 0; j < 4; ++j) {
+      lane[j] = std::rotl(lane[j] + w[j]*kPrime2, 31)*kPrime1;
+    }
+  }
+  auto h = std::rotl(lane[0], 1) + std::rotl(lane[1], 7) +
+           std::rotl(lane[2], 12) + std::rotl(lane[3], 18);
+  for (; i+8 <= n; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, p+i, sizeof(w));
+    h = HashCombine(h, w);
+  }
+  if (i < n) {
+    uint64_t w = 0;
+    std::memcpy(&w, p+i, n-i);
+    h = HashCombine(h, w);
+  }
+  return Mix(h ^ n);
+}
+
+
 void Value::Serialize(Packer& pk) const {
   if (isInteger()) {
     pk.pack(integer());
@@ -108,6 +157,41 @@ std::string Value::Stringify(size_t max) const noexcept {
   return "???";
 }
 
+size_t Value::hash() const noexcept {
+  const auto seed = static_cast<uint64_t>(v_.index());
+  if (isInteger()) {
+    return static_cast<size_t>(HashCombine(seed, static_cast<uint64_t>(integer())));
+  }
+  if (isScalar()) {
+    // -0.0 equals to 0.0
+    const auto s = scalar();
+    return static_cast<size_t>(HashCombine(seed, std::bit_cast<uint64_t>(s == 0? 0.: s)));
+  }
+  if (isBoolean()) {
+    return static_cast<size_t>(HashCombine(seed, boolean()));
+  }
+  if (isString()) {
+    const auto& str = string();
+    return static_cast<size_t>(HashBytes(
+            {reinterpret_cast<const uint8_t*>(str.data()), str.size()}, seed));
+  }
+  if (isTensor()) {
+    return static_cast<size_t>(HashCombine(seed, tensor().hash()));
+  }
+  if (isData()) {
+    return static_cast<size_t>(HashCombine(
+            seed, reinterpret_cast<uintptr_t>(dataPtr().get())));
+  }
+  if (isTuple()) {
+    const auto& tup = tuple();
+
+    auto ret = HashCombine(seed, tup.size());
+    for (const auto& v : tup) ret = HashCombine(ret, v.hash());
+    return static_cast<size_t>(ret);
+  }
+  return static_cast<size_t>(Mix(seed));  // pulse
+}
+
 bool operator==(const Value& a, const Value& b) noexcept {
   if (a.isPulse() && b.isPulse()) {
     return true;
@@ -115,15 +199,36 @@ bool operator==(const Value& a, const Value& b) noexcept {
   if (a.isInteger() && b.isInteger()) {
     return a.integer() == b.integer();
   }
-  if (b.isScalar() && b.isScalar()) {
+  if (a.isScalar() && b.isScalar()) {
     return a.scalar() == b.scalar();
   }
-  if (b.isBoolean() && b.isBoolean()) {
+  if (a.isBoolean() && b.isBoolean()) {
     return a.boolean() == b.boolean();
   }
-  if (b.isString() && b.isString()) {
+  if (a.isString() && b.isString()) {
     return a.string() == b.string();
   }
+  if (a.isTensor() && b.isTensor()) {
+    const auto& ta = a.tensor();
+    const auto& tb = b.tensor();
+    if (&ta == &tb) return true;
+    if (ta.type() != tb.type()) return false;
+
+    const auto da = ta.dim(), db = tb.dim();
+    if (!std::equal(da.begin(), da.end(), db.begin(), db.end())) return false;
+
+    const auto ba = ta.ptr(), bb = tb.ptr();
+    return std::equal(ba.begin(), ba.end(), bb.begin(), bb.end());
+  }
+  if (a.isData() && b.isData()) {
+    return a.dataPtr() == b.dataPtr();
+  }
+  if (a.isTuple() && b.isTuple()) {
+    const auto& ta = a.tuple();
+    const auto& tb = b.tuple();
+    if (&ta == &tb) return true;
+    return std::equal(ta.begin(), ta.end(), tb.begin(), tb.end());
+  }
   return false;
 }
 
@@ -211,6 +316,20 @@ std::string Value::Tensor::StringifyMeta() const noexcept {
   return ret;
 }
 
+size_t Value::Tensor::hash() const noexcept {
+  if (const auto v = hash_.v.load(std::memory_order_relaxed)) {
+    return static_cast<size_t>(v);
+  }
+  auto h = HashCombine(type_, dim_.size());
+  for (auto d : dim_) h = HashCombine(h, d);
+  h = HashBytes(buf_, h);
+
+  // 0 is reserved for the empty cache
+  if (h == 0) h = 1;
+  hash_.v.store(h, std::memory_order_relaxed);
+  return static_cast<size_t>(h);
+}
+
 
 Value::Tuple::Tuple(const msgpack::object& obj)
 try {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <span>
@@ -78,6 +79,13 @@ class Value final {
   const char* StringifyType() const noexcept;
   std::string Stringify(size_t max = 64) const noexcept;
 
+  // Returns a hash of the content, which is equal between values that
+  // operator== says equal. Data is hashed by its identity.
+  size_t hash() const noexcept;
+  struct Hash final {
+    size_t operator()(const Value& v) const noexcept { return v.hash(); }
+  };
+
   bool isPulse() const noexcept {
     return std::holds_alternative<Pulse>(v_);
   }
@@ -257,11 +265,14 @@ class Value::Tensor final {
 
   Type type() const noexcept { return type_; }
 
+  // taking a mutable buffer drops the cached hash,
+  // so don't keep the span across hash() calls
   template <typename T>
   std::span<T> ptr() {
     if (type_ != GetTypeOf<T>::value) {
       throw TypeUnmatchException(GetTypeOf<T>::value, type_);
     }
+    hash_.Clear();
     return {reinterpret_cast<T*>(&buf_[0]), buf_.size()/sizeof(T)};
   }
   template <typename T>
@@ -272,7 +283,10 @@ class Value::Tensor final {
     return {&buf_[0], buf_.size()/sizeof(T)};
   }
 
-  std::span<uint8_t> ptr() noexcept { return buf_; }
+  std::span<uint8_t> ptr() noexcept {
+    hash_.Clear();
+    return buf_;
+  }
   std::span<const uint8_t> ptr() const noexcept { return buf_; }
 
   std::span<const size_t> dim() const noexcept { return dim_; }
@@ -283,10 +297,29 @@ class Value::Tensor final {
   size_t samples() const noexcept { return buf_.size()/(type_&0xFF); }
   size_t bytes() const noexcept { return buf_.size(); }
 
+  // hashes type, dims and buffer, and caches the result (thread-safe)
+  size_t hash() const noexcept;
+
  private:
+  // copied with the buffer, 0 means not computed yet
+  struct HashCache final {
+   public:
+    HashCache() = default;
+    HashCache(const HashCache& other) noexcept : v(other.v.load(std::memory_order_relaxed)) { }
+    HashCache& operator=(const HashCache& other) noexcept {
+      v.store(other.v.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      return *this;
+    }
+    void Clear() noexcept { v.store(0, std::memory_order_relaxed); }
+
+    mutable std::atomic<uint64_t> v = 0;
+  };
+
   Type type_;
   std::vector<size_t>  dim_;
   std::vector<uint8_t> buf_;
+
+  HashCache hash_;
 };
 template <> struct Value::Tensor::GetTypeOf<int8_t> { static constexpr Type value = I8; };
 template <> struct Value::Tensor::GetTypeOf<int16_t> { static constexpr Type value = I16; };